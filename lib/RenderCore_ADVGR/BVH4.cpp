@@ -0,0 +1,258 @@
+#include "BVHNode.h"
+
+//  +-----------------------------------------------------------------------------+
+//  |  BVH::CollapseToBVH4                                                        |
+//  |  Builds the 4-wide tree from the binary one. Each wide node takes the       |
+//  |  children of a binary node and keeps opening the largest interior child     |
+//  |  until it has four, which removes every other level of the binary tree.     |
+//  +-----------------------------------------------------------------------------+
+void BVH::CollapseToBVH4()
+{
+	wideNodes.clear();
+
+	if (triangleCount == 0)
+	{
+		return;
+	}
+
+	wideNodes.reserve(nodesUsed / 2 + 1);
+	wideNodes.emplace_back();
+	CollapseNode(0, 0);
+}
+
+void BVH::CollapseNode(int nodeIdx, int wideIdx)
+{
+	int children[4] = { nodeIdx };
+	int childCount = 1;
+
+	if (!nodes[nodeIdx].IsLeaf())
+	{
+		children[0] = nodes[nodeIdx].leftFirst;
+		children[1] = nodes[nodeIdx].leftFirst + 1;
+		childCount = 2;
+
+		while (childCount < 4)
+		{
+			int largest = -1;
+			float largestArea = -1;
+
+			for (int i = 0; i < childCount; i++)
+			{
+				const BVHNode& child = nodes[children[i]];
+				float area = CalculateSurfaceArea(AABB(child.minBounds, child.maxBounds));
+
+				if (!child.IsLeaf() && area > largestArea)
+				{
+					largest = i;
+					largestArea = area;
+				}
+			}
+
+			if (largest == -1)
+			{
+				break;
+			}
+
+			int opened = children[largest];
+			children[largest] = nodes[opened].leftFirst;
+			children[childCount++] = nodes[opened].leftFirst + 1;
+		}
+	}
+
+	// Wide children are allocated first and recursed into afterwards; emplace_back may
+	// move the node we are filling in.
+	int recurse[4];
+	int recurseWide[4];
+	int recurseCount = 0;
+
+	for (int i = 0; i < 4; i++)
+	{
+		BVH4Node& wideNode = wideNodes[wideIdx];
+
+		if (i >= childCount)
+		{
+			wideNode.minX[i] = wideNode.minY[i] = wideNode.minZ[i] = numeric_limits<float>::infinity();
+			wideNode.maxX[i] = wideNode.maxY[i] = wideNode.maxZ[i] = numeric_limits<float>::infinity();
+			wideNode.child[i] = -1;
+			wideNode.count[i] = 0;
+			continue;
+		}
+
+		const BVHNode& child = nodes[children[i]];
+		wideNode.minX[i] = child.minBounds.x, wideNode.minY[i] = child.minBounds.y, wideNode.minZ[i] = child.minBounds.z;
+		wideNode.maxX[i] = child.maxBounds.x, wideNode.maxY[i] = child.maxBounds.y, wideNode.maxZ[i] = child.maxBounds.z;
+
+		if (child.IsLeaf())
+		{
+			wideNode.child[i] = child.leftFirst;
+			wideNode.count[i] = child.count;
+		}
+		else
+		{
+			wideNode.child[i] = (int)wideNodes.size();
+			wideNode.count[i] = 0;
+
+			recurse[recurseCount] = children[i];
+			recurseWide[recurseCount++] = (int)wideNodes.size();
+			wideNodes.emplace_back();
+		}
+	}
+
+	for (int i = 0; i < recurseCount; i++)
+	{
+		CollapseNode(recurse[i], recurseWide[i]);
+	}
+}
+
+// Pending child of a wide node; count > 0 for leaves, as in BVH4Node.
+struct BVH4StackEntry
+{
+	int child;
+	int count;
+	float distance;
+};
+
+//  +-----------------------------------------------------------------------------+
+//  |  BVH::IntersectBVH4                                                         |
+//  |  Closest hit through the 4-wide tree. All children of a node are tested     |
+//  |  with one SSE slab test; the ones that are hit are pushed far to near, so   |
+//  |  the nearest child is visited next.                                         |
+//  +-----------------------------------------------------------------------------+
+void BVH::IntersectBVH4(const Ray& ray, HitRecord& hit)
+{
+	const __m128 ox = _mm_set1_ps(ray.m_Origin.x), oy = _mm_set1_ps(ray.m_Origin.y), oz = _mm_set1_ps(ray.m_Origin.z);
+	const __m128 rdx = _mm_set1_ps(1.0f / ray.m_Direction.x), rdy = _mm_set1_ps(1.0f / ray.m_Direction.y), rdz = _mm_set1_ps(1.0f / ray.m_Direction.z);
+	const __m128 zero = _mm_setzero_ps();
+	const ShearedRay sheared(ray);
+
+	// Every visited node replaces itself with at most four children; see WIDE_STACKSIZE.
+	BVH4StackEntry stack[WIDE_STACKSIZE];
+	int stackPtr = 0;
+	stack[stackPtr++] = { 0, 0, -numeric_limits<float>::max() };
+
+	while (stackPtr > 0)
+	{
+		BVH4StackEntry entry = stack[--stackPtr];
+
+		if (entry.distance >= hit.t)
+		{
+			continue;
+		}
+
+		if (entry.count > 0)
+		{
+			IntersectLeaf(sheared, entry.child, entry.count, hit);
+			continue;
+		}
+
+		const BVH4Node& node = wideNodes[entry.child];
+
+		__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minX), ox), rdx);
+		__m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxX), ox), rdx);
+		__m128 tmin = _mm_min_ps(tx1, tx2);
+		__m128 tmax = _mm_max_ps(tx1, tx2);
+
+		__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minY), oy), rdy);
+		__m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxY), oy), rdy);
+		tmin = _mm_max_ps(tmin, _mm_min_ps(ty1, ty2));
+		tmax = _mm_min_ps(tmax, _mm_max_ps(ty1, ty2));
+
+		__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minZ), oz), rdz);
+		__m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxZ), oz), rdz);
+		tmin = _mm_max_ps(tmin, _mm_min_ps(tz1, tz2));
+		tmax = _mm_min_ps(tmax, _mm_max_ps(tz1, tz2));
+
+		tmax = _mm_mul_ps(tmax, _mm_set1_ps(BOX_EXIT_SCALE));
+		__m128 hitMask = _mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_cmpge_ps(tmax, zero));
+		hitMask = _mm_and_ps(hitMask, _mm_cmplt_ps(tmin, _mm_set1_ps(hit.t)));
+		int mask = _mm_movemask_ps(hitMask);
+
+		if (mask == 0)
+		{
+			continue;
+		}
+
+		alignas(16) float distance[4];
+		_mm_store_ps(distance, tmin);
+
+		// Insert the hit children sorted on distance, farthest at the bottom.
+		assert(stackPtr + 4 <= WIDE_STACKSIZE);
+		int first = stackPtr;
+		for (int i = 0; i < 4; i++)
+		{
+			if (!(mask & (1 << i)))
+			{
+				continue;
+			}
+
+			BVH4StackEntry child = { node.child[i], node.count[i], distance[i] };
+			int j = stackPtr++;
+			while (j > first && stack[j - 1].distance < child.distance)
+			{
+				stack[j] = stack[j - 1];
+				j--;
+			}
+			stack[j] = child;
+		}
+	}
+}
+
+bool BVH::IsOccludedBVH4(const Ray& ray, float tMax)
+{
+	const __m128 ox = _mm_set1_ps(ray.m_Origin.x), oy = _mm_set1_ps(ray.m_Origin.y), oz = _mm_set1_ps(ray.m_Origin.z);
+	const __m128 rdx = _mm_set1_ps(1.0f / ray.m_Direction.x), rdy = _mm_set1_ps(1.0f / ray.m_Direction.y), rdz = _mm_set1_ps(1.0f / ray.m_Direction.z);
+	const __m128 zero = _mm_setzero_ps(), limit = _mm_set1_ps(tMax);
+	const ShearedRay sheared(ray);
+
+	// Any blocker will do, so children are pushed in whatever order they come.
+	BVH4StackEntry stack[WIDE_STACKSIZE];
+	int stackPtr = 0;
+	stack[stackPtr++] = { 0, 0, 0 };
+
+	while (stackPtr > 0)
+	{
+		BVH4StackEntry entry = stack[--stackPtr];
+
+		if (entry.count > 0)
+		{
+			if (IsOccludedLeaf(sheared, entry.child, entry.count, tMax))
+			{
+				return true;
+			}
+
+			continue;
+		}
+
+		const BVH4Node& node = wideNodes[entry.child];
+
+		__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minX), ox), rdx);
+		__m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxX), ox), rdx);
+		__m128 tmin = _mm_min_ps(tx1, tx2);
+		__m128 tmax = _mm_max_ps(tx1, tx2);
+
+		__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minY), oy), rdy);
+		__m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxY), oy), rdy);
+		tmin = _mm_max_ps(tmin, _mm_min_ps(ty1, ty2));
+		tmax = _mm_min_ps(tmax, _mm_max_ps(ty1, ty2));
+
+		__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minZ), oz), rdz);
+		__m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxZ), oz), rdz);
+		tmin = _mm_max_ps(tmin, _mm_min_ps(tz1, tz2));
+		tmax = _mm_min_ps(tmax, _mm_max_ps(tz1, tz2));
+
+		tmax = _mm_mul_ps(tmax, _mm_set1_ps(BOX_EXIT_SCALE));
+		__m128 hitMask = _mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_cmpge_ps(tmax, zero));
+		int mask = _mm_movemask_ps(_mm_and_ps(hitMask, _mm_cmplt_ps(tmin, limit)));
+		assert(stackPtr + 4 <= WIDE_STACKSIZE);
+
+		for (int i = 0; i < 4; i++)
+		{
+			if (mask & (1 << i))
+			{
+				stack[stackPtr++] = { node.child[i], node.count[i], 0 };
+			}
+		}
+	}
+
+	return false;
+}
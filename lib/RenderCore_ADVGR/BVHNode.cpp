@@ -1,447 +1,1107 @@
 #include "BVHNode.h"
 
-void BVHNode::Intersect(Ray& ray, vector<BVHNode>& hitNode)
+void BVH::Intersect(const Ray& ray, HitRecord& hit)
 {
-	float3 invD = 1.0f / ray.m_Direction;
-	float3 min = bounds.minBounds;
-	float3 max = bounds.maxBounds;
-
-	float tmin = (min.x - ray.m_Origin.x) * invD.x;
-	float tmax = (max.x - ray.m_Origin.x) * invD.x;
-
-	if (tmin > tmax) 
+	if (triangleCount == 0)
 	{
-		std::swap(tmin, tmax);
+		return;
 	}
 
-	float tymin = (min.y - ray.m_Origin.y) * invD.y;
-	float tymax = (max.y - ray.m_Origin.y) * invD.y;
-
-	if (tymin > tymax) 
+	if (wide)
 	{
-		std::swap(tymin, tymax);
+		IntersectBVH4(ray, hit);
+		return;
 	}
 
-	if ((tmin > tymax) || (tymin > tmax)) 
+	float3 invD = 1.0f / ray.m_Direction;
+	const ShearedRay sheared(ray);
+
+	if (IntersectAABB(ray, invD, nodes[0], hit.t) == numeric_limits<float>::max())
 	{
 		return;
 	}
 
-	tmin = std::fmax(tymin, tmin);
-	tmax = std::fmin(tymax, tmax);
+	// Nodes still to be visited, with the distance at which the ray enters them; at most
+	// one per level, and the builder limits the depth to MAXDEPTH.
+	const BVHNode* stack[STACKSIZE];
+	float stackDistance[STACKSIZE];
+	int stackPtr = 0;
+	const BVHNode* node = &nodes[0];
+
+	while (true)
+	{
+		if (node->IsLeaf())
+		{
+			IntersectLeaf(sheared, node->leftFirst, node->count, hit);
+		}
+		else
+		{
+			// Visit the nearer child first and defer the farther one.
+			const BVHNode* nearChild = &nodes[node->leftFirst];
+			const BVHNode* farChild = nearChild + 1;
+			float nearDistance = IntersectAABB(ray, invD, *nearChild, hit.t);
+			float farDistance = IntersectAABB(ray, invD, *farChild, hit.t);
+
+			if (nearDistance > farDistance)
+			{
+				std::swap(nearDistance, farDistance);
+				std::swap(nearChild, farChild);
+			}
+
+			if (nearDistance != numeric_limits<float>::max())
+			{
+				if (farDistance != numeric_limits<float>::max())
+				{
+					assert(stackPtr < STACKSIZE);
+					stack[stackPtr] = farChild;
+					stackDistance[stackPtr++] = farDistance;
+				}
+
+				node = nearChild;
+				continue;
+			}
+		}
+
+		// Pop the nearest deferred node that can still contain a closer hit.
+		node = 0;
+		while (stackPtr > 0 && node == 0)
+		{
+			stackPtr--;
+			if (stackDistance[stackPtr] < hit.t)
+			{
+				node = stack[stackPtr];
+			}
+		}
 
-	float tzmin = (min.z - ray.m_Origin.z) * invD.z;
-	float tzmax = (max.z - ray.m_Origin.z) * invD.z;
+		if (node == 0)
+		{
+			return;
+		}
+	}
+}
 
-	if (tzmin > tzmax) 
+bool BVH::IsOccluded(const Ray& ray, float tMax)
+{
+	if (triangleCount == 0)
 	{
-		std::swap(tzmin, tzmax);
+		return false;
 	}
 
-	if ((tmin > tzmax) || (tzmin > tmax)) 
+	if (wide)
 	{
-		return;
+		return IsOccludedBVH4(ray, tMax);
 	}
 
-	tmin = std::fmax(tzmin, tmin);
-	tmax = std::fmin(tzmax, tmax);
+	float3 invD = 1.0f / ray.m_Direction;
+	const ShearedRay sheared(ray);
+
+	// Any blocker will do, so the traversal order does not matter here.
+	const BVHNode* stack[STACKSIZE];
+	int stackPtr = 0;
+	stack[stackPtr++] = &nodes[0];
 
-	if (m_IsLeaf)
+	while (stackPtr > 0)
 	{
-		// True.
-		hitNode.push_back(*this);
+		const BVHNode* node = stack[--stackPtr];
+
+		if (IntersectAABB(ray, invD, *node, tMax) == numeric_limits<float>::max())
+		{
+			continue;
+		}
+
+		if (node->IsLeaf())
+		{
+			if (IsOccludedLeaf(sheared, node->leftFirst, node->count, tMax))
+			{
+				return true;
+			}
+		}
+		else
+		{
+			assert(stackPtr + 2 <= STACKSIZE);
+			stack[stackPtr++] = &nodes[node->leftFirst + 1];
+			stack[stackPtr++] = &nodes[node->leftFirst];
+		}
 	}
-	else
+
+	return false;
+}
+
+// Bound on the rounding error of a * b - c * d in float, relative to |a * b| + |c * d|.
+static constexpr float EDGE_FUNCTION_ERROR = 2.5e-7f;
+
+//  +-----------------------------------------------------------------------------+
+//  |  RefineEdgeFunctions                                                        |
+//  |  Rounding can flip the sign of an edge function close to zero, which still  |
+//  |  opens cracks at vertices. Lanes in mask are recomputed in double from the  |
+//  |  same sheared coordinates; the product of two floats is exact there, so     |
+//  |  the signs come out right and neighbouring triangles agree.                 |
+//  +-----------------------------------------------------------------------------+
+static void RefineEdgeFunctions(int mask, const float* ax, const float* ay, const float* bx, const float* by, const float* cx, const float* cy, float* U, float* V, float* W)
+{
+	for (int lane = 0; mask != 0; lane++, mask >>= 1)
 	{
-		m_Left->Intersect(ray, hitNode);
-		m_Right->Intersect(ray, hitNode);
+		if (mask & 1)
+		{
+			U[lane] = (float)((double)cx[lane] * by[lane] - (double)cy[lane] * bx[lane]);
+			V[lane] = (float)((double)ax[lane] * cy[lane] - (double)ay[lane] * cx[lane]);
+			W[lane] = (float)((double)bx[lane] * ay[lane] - (double)by[lane] * ax[lane]);
+		}
 	}
 }
 
-void BVHNode::ConstructBVH(Mesh& mesh)
+//  +-----------------------------------------------------------------------------+
+//  |  BVH::IntersectTriangleGroup                                                |
+//  |  Watertight ray/triangle test (Woop, Benthin and Wald, 2013) against the    |
+//  |  four triangles of a group. The vertices are moved into the sheared frame   |
+//  |  of the ray and the hit is decided by the signs of the 2D edge functions.   |
+//  |  A shared edge yields the same values in both triangles, so no ray slips    |
+//  |  between them. Returns the distance per lane, or max float                  |
+//  |  where the ray misses, and the barycentrics of vertex1 and vertex2 in u     |
+//  |  and v.                                                                     |
+//  +-----------------------------------------------------------------------------+
+__m128 BVH::IntersectTriangleGroup(const ShearedRay& ray, const TriangleGroup& group, __m128& u, __m128& v)
 {
-	for (int i = 0; i < mesh.vcount / 3; i++)
+	const int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+	const __m128 ox = _mm_set1_ps(ray.origin[kx]), oy = _mm_set1_ps(ray.origin[ky]), oz = _mm_set1_ps(ray.origin[kz]);
+	const __m128 Sx = _mm_set1_ps(ray.Sx), Sy = _mm_set1_ps(ray.Sy), Sz = _mm_set1_ps(ray.Sz);
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+
+	// vertices relative to the ray origin, sheared so the ray runs along z
+	const __m128 Az = _mm_sub_ps(_mm_load_ps(group.v0[kz]), oz);
+	const __m128 Bz = _mm_sub_ps(_mm_load_ps(group.v1[kz]), oz);
+	const __m128 Cz = _mm_sub_ps(_mm_load_ps(group.v2[kz]), oz);
+	const __m128 Ax = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.v0[kx]), ox), _mm_mul_ps(Sx, Az));
+	const __m128 Ay = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.v0[ky]), oy), _mm_mul_ps(Sy, Az));
+	const __m128 Bx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.v1[kx]), ox), _mm_mul_ps(Sx, Bz));
+	const __m128 By = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.v1[ky]), oy), _mm_mul_ps(Sy, Bz));
+	const __m128 Cx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.v2[kx]), ox), _mm_mul_ps(Sx, Cz));
+	const __m128 Cy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.v2[ky]), oy), _mm_mul_ps(Sy, Cz));
+
+	// scaled barycentrics; the ray passes inside when they share a sign, from either side
+	__m128 U = _mm_sub_ps(_mm_mul_ps(Cx, By), _mm_mul_ps(Cy, Bx));
+	__m128 V = _mm_sub_ps(_mm_mul_ps(Ax, Cy), _mm_mul_ps(Ay, Cx));
+	__m128 W = _mm_sub_ps(_mm_mul_ps(Bx, Ay), _mm_mul_ps(By, Ax));
+
+	const __m128 sign = _mm_set1_ps(-0.0f), error = _mm_set1_ps(EDGE_FUNCTION_ERROR);
+	__m128 inexact = _mm_cmple_ps(_mm_andnot_ps(sign, U), _mm_mul_ps(error, _mm_add_ps(_mm_andnot_ps(sign, _mm_mul_ps(Cx, By)), _mm_andnot_ps(sign, _mm_mul_ps(Cy, Bx)))));
+	inexact = _mm_or_ps(inexact, _mm_cmple_ps(_mm_andnot_ps(sign, V), _mm_mul_ps(error, _mm_add_ps(_mm_andnot_ps(sign, _mm_mul_ps(Ax, Cy)), _mm_andnot_ps(sign, _mm_mul_ps(Ay, Cx))))));
+	inexact = _mm_or_ps(inexact, _mm_cmple_ps(_mm_andnot_ps(sign, W), _mm_mul_ps(error, _mm_add_ps(_mm_andnot_ps(sign, _mm_mul_ps(Bx, Ay)), _mm_andnot_ps(sign, _mm_mul_ps(By, Ax))))));
+
+	if (int mask = _mm_movemask_ps(inexact))
 	{
-		primitives.push_back(mesh.triangles[i]);
+		alignas(16) float ax[4], ay[4], bx[4], by[4], cx[4], cy[4], eu[4], ev[4], ew[4];
+		_mm_store_ps(ax, Ax), _mm_store_ps(ay, Ay), _mm_store_ps(bx, Bx), _mm_store_ps(by, By), _mm_store_ps(cx, Cx), _mm_store_ps(cy, Cy);
+		_mm_store_ps(eu, U), _mm_store_ps(ev, V), _mm_store_ps(ew, W);
+		RefineEdgeFunctions(mask, ax, ay, bx, by, cx, cy, eu, ev, ew);
+		U = _mm_load_ps(eu), V = _mm_load_ps(ev), W = _mm_load_ps(ew);
 	}
 
-	m_IsLeaf = false;
-	m_Root = NULL;
+	const __m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(U, zero), _mm_cmplt_ps(V, zero)), _mm_cmplt_ps(W, zero));
+	const __m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(U, zero), _mm_cmpgt_ps(V, zero)), _mm_cmpgt_ps(W, zero));
+	const __m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
 
-	bounds = CalculateVoxelBounds(primitives);
-	//Partition_SAH(INT_MAX);
-	Partition_Binned_SAH();
+	const __m128 T = _mm_mul_ps(Sz, _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, Az), _mm_mul_ps(V, Bz)), _mm_mul_ps(W, Cz)));
+	const __m128 rcpDet = _mm_div_ps(one, det);
+	const __m128 t = _mm_mul_ps(T, rcpDet);
+	u = _mm_mul_ps(V, rcpDet);
+	v = _mm_mul_ps(W, rcpDet);
+
+	__m128 hit = _mm_andnot_ps(_mm_and_ps(negative, positive), _mm_cmpneq_ps(det, zero));
+	hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(EPSILON)), _mm_cmplt_ps(t, _mm_set1_ps(1 / EPSILON))));
+
+	return _mm_blendv_ps(_mm_set1_ps(numeric_limits<float>::max()), t, hit);
 }
 
-void BVHNode::Partition_Binned_SAH()
+// Closest hit among the triangles of a leaf; first and count as in BVHNode.
+void BVH::IntersectLeaf(const ShearedRay& ray, int first, int count, HitRecord& hit)
 {
-	if (this->primitives.size() < 3) {
-		this->m_Root->m_IsLeaf = true;
-		return;
-	}
-	else
+	const TriangleGroup* group = &triangleGroups[groupFirst[first]];
+
+	for (int i = 0; i < count; i += 4, group++)
 	{
-		// The bounding box of every single triangle in the mesh.
-		vector<AABB> tb;
-		// The centroid of every bounding box of a triangle.
-		vector<float3> c;
-		// The bounding box of a voxel/whole mesh.
-		AABB vb{ make_float3(INT_MAX) , make_float3(INT_MIN) };
-		// The bounding box for all centroids.
-		AABB cb{ make_float3(INT_MAX) , make_float3(INT_MIN) };
+		__m128 u, v;
+		__m128 t = IntersectTriangleGroup(ray, *group, u, v);
+		int mask = _mm_movemask_ps(_mm_cmplt_ps(t, _mm_set1_ps(hit.t)));
 
-		for (int i = 0; i < primitives.size(); i++)
+		if (mask == 0)
 		{
-			// Calculate bounding box of current primitive.
-			AABB bb = CalculateTriangleBounds(primitives[i]);
-			// Save bounding box of this primitive.
-			tb.push_back(bb);
-			// Save the centroid of this bounding box.
-			c.push_back(CalculateBoundingBoxCenter(bb));
-
-			// Check whether the bounds of this primitive are min/max of voxel.
-			vb.minBounds = fminf(bb.minBounds, vb.minBounds);
-			vb.maxBounds = fmaxf(bb.maxBounds, vb.maxBounds);
-			// Do the same for every centroid.
-			cb.minBounds = fminf(c[i], cb.minBounds);
-			cb.maxBounds = fmaxf(c[i], cb.maxBounds);
+			continue;
 		}
 
-		// Check which axis is the longest.
-		Axis longestAxis;
-		float xScale = vb.maxBounds.x - vb.minBounds.x;
-		float yScale = vb.maxBounds.y - vb.minBounds.y;
-		float zScale = vb.maxBounds.z - vb.minBounds.z;
-		if ((xScale >= yScale) && (xScale >= zScale)) longestAxis = X;
-		if ((yScale >= xScale) && (yScale >= zScale)) longestAxis = Y;
-		if ((zScale >= xScale) && (zScale >= yScale)) longestAxis = Z;
-
-		float maxCentroid;
-		float minCentroid;
-
-		// Number of bins.
-		constexpr uint K = 8;
-		// Bin distance.
-		float k;
-
-		if (longestAxis == X) {
-			maxCentroid = cb.maxBounds.x;
-			minCentroid = cb.minBounds.x;
-			k = K * (1 - EPSILON) / ((cb.maxBounds.x + EPSILON) - (cb.minBounds.x - EPSILON));
-		}
-		if (longestAxis == Y) {
-			maxCentroid = cb.maxBounds.y;
-			minCentroid = cb.minBounds.y;
-			k = K * (1 - EPSILON) / ((cb.maxBounds.y + EPSILON) - (cb.minBounds.y - EPSILON));
-		}
-		if (longestAxis == Z) {
-			maxCentroid = cb.maxBounds.z;
-			minCentroid = cb.minBounds.z;
-			k = K * (1 - EPSILON) / ((cb.maxBounds.z + EPSILON) - (cb.minBounds.z - EPSILON));
+		alignas(16) float distance[4], bu[4], bv[4];
+		_mm_store_ps(distance, t);
+		_mm_store_ps(bu, u);
+		_mm_store_ps(bv, v);
+
+		for (int lane = 0; lane < 4; lane++)
+		{
+			if (distance[lane] < hit.t)
+			{
+				hit.t = distance[lane];
+				hit.triIdx = group->triIdx[lane];
+				hit.u = bu[lane], hit.v = bv[lane];
+			}
 		}
+	}
+}
+
+bool BVH::IsOccludedLeaf(const ShearedRay& ray, int first, int count, float tMax)
+{
+	const TriangleGroup* group = &triangleGroups[groupFirst[first]];
 
-		// Assign primitives over the K bins we have.
-		vector<int> binID;
-		// Count the number of primitives in each bin.
-		int numberOfTrianglesInBin[K] = {};
-		// Calculate the bounding box for each bin.
-		AABB bbOfBin[K] = {};
-		for (uint i = 0; i < primitives.size(); i++)
+	for (int i = 0; i < count; i += 4, group++)
+	{
+		__m128 u, v;
+		if (_mm_movemask_ps(_mm_cmplt_ps(IntersectTriangleGroup(ray, *group, u, v), _mm_set1_ps(tMax))))
 		{
-			// Assign each primitive to the appropriate bin.
-			int id;
-			if (longestAxis == X) id = (int)(k * (c[i].x - cb.minBounds.x));
-			if (longestAxis == Y) id = (int)(k * (c[i].y - cb.minBounds.y));
-			if (longestAxis == Z) id = (int)(k * (c[i].z - cb.minBounds.z));
+			return true;
+		}
+	}
 
-			binID.push_back(id);
+	return false;
+}
 
-			numberOfTrianglesInBin[binID[i]]++;
+float BVH::IntersectAABB(const Ray& ray, const float3& invD, const BVHNode& node, float tMax)
+{
+	float tx1 = (node.minBounds.x - ray.m_Origin.x) * invD.x;
+	float tx2 = (node.maxBounds.x - ray.m_Origin.x) * invD.x;
+	float tmin = std::fmin(tx1, tx2);
+	float tmax = std::fmax(tx1, tx2);
+
+	float ty1 = (node.minBounds.y - ray.m_Origin.y) * invD.y;
+	float ty2 = (node.maxBounds.y - ray.m_Origin.y) * invD.y;
+	tmin = std::fmax(tmin, std::fmin(ty1, ty2));
+	tmax = std::fmin(tmax, std::fmax(ty1, ty2));
+
+	float tz1 = (node.minBounds.z - ray.m_Origin.z) * invD.z;
+	float tz2 = (node.maxBounds.z - ray.m_Origin.z) * invD.z;
+	tmin = std::fmax(tmin, std::fmin(tz1, tz2));
+	tmax = std::fmin(tmax, std::fmax(tz1, tz2));
+
+	// Miss, box behind the ray, or box beyond the closest hit found so far.
+	tmax *= BOX_EXIT_SCALE;
+	if (tmax < tmin || tmax < 0 || tmin >= tMax)
+	{
+		return numeric_limits<float>::max();
+	}
 
-			bbOfBin[binID[i]].minBounds = fminf(bbOfBin[binID[i]].minBounds, tb[i].minBounds);
-			bbOfBin[binID[i]].maxBounds = fmaxf(bbOfBin[binID[i]].maxBounds, tb[i].maxBounds);
-		}
+	return tmin;
+}
 
-		// plane[0] will have bin[0] on the left and bin[1] to the right.
-		constexpr int number_of_planes = K - 1;
-		// Number of triangles on the left side of the plane.
-		int trianglesLeft[number_of_planes] = {};
-		// Surface area of the bounding box on the left side of the plane.
-		float saBBleft[number_of_planes] = {};
-		// Number of triangles on the right side of the plane.
-		int trianglesRight[number_of_planes] = {};
-		// Surface area of the bounding box on the right side of the plane.
-		float saBBright[number_of_planes] = {};
-
-		uint numberOfTrianglesLeft = 0;
-		AABB bbLeft;
-		for (int j = 0; j < number_of_planes; j++)
-		{
-			numberOfTrianglesLeft += numberOfTrianglesInBin[j];
-			trianglesLeft[j] = numberOfTrianglesLeft;
+static float HorizontalMin(__m256 v)
+{
+	__m128 m = _mm_min_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	m = _mm_min_ps(m, _mm_movehl_ps(m, m));
+	m = _mm_min_ss(m, _mm_shuffle_ps(m, m, 1));
+	return _mm_cvtss_f32(m);
+}
 
-			bbLeft = bbOfBin[j];
-			if (bbLeft.minBounds.x == INT_MAX && bbLeft.minBounds.y == INT_MAX && bbLeft.minBounds.z == INT_MAX &&
-				bbLeft.maxBounds.x == INT_MIN && bbLeft.maxBounds.y == INT_MIN && bbLeft.maxBounds.z == INT_MIN)
-				saBBleft[j] = 0;
-			else
-				saBBleft[j] = CalculateSurfaceArea(bbLeft);
-		}
+static float HorizontalMax(__m256 v)
+{
+	__m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+	m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+	return _mm_cvtss_f32(m);
+}
 
-		uint numberOfTrianglesRight = 0;
-		AABB bbRight;
-		for (int j = (number_of_planes - 1); j >= 0; j--)
+//  +-----------------------------------------------------------------------------+
+//  |  BVH::IntersectPacket                                                       |
+//  |  Traces a packet of coherent rays front to back. A node is visited when     |
+//  |  any ray in the packet hits it, and skipped once every ray has a hit that   |
+//  |  is closer than the node.                                                   |
+//  +-----------------------------------------------------------------------------+
+void BVH::IntersectPacket(RayPacket& packet)
+{
+	if (triangleCount == 0)
+	{
+		return;
+	}
+
+	float maxT = PacketMaxT(packet);
+
+	if (IntersectAABBPacket(packet, nodes[0], maxT) == numeric_limits<float>::max())
+	{
+		return;
+	}
+
+	const BVHNode* stack[STACKSIZE];
+	float stackDistance[STACKSIZE];
+	int stackPtr = 0;
+	const BVHNode* node = &nodes[0];
+
+	while (true)
+	{
+		if (node->IsLeaf())
 		{
-			numberOfTrianglesRight += numberOfTrianglesInBin[j + 1];
-			trianglesRight[j] = numberOfTrianglesRight;
-
-			bbRight = bbOfBin[j + 1];
-			if (bbRight.minBounds.x == INT_MAX && bbRight.minBounds.y == INT_MAX && bbRight.minBounds.z == INT_MAX &&
-				bbRight.maxBounds.x == INT_MIN && bbRight.maxBounds.y == INT_MIN && bbRight.maxBounds.z == INT_MIN)
-				saBBright[j] = 0;
-			else
-				saBBright[j] = CalculateSurfaceArea(bbRight);
+			const TriangleGroup* group = &triangleGroups[groupFirst[node->leftFirst]];
+			for (int i = 0; i < node->count; i++)
+			{
+				IntersectTrianglePacket(packet, group[i / 4], i & 3);
+			}
+
+			maxT = PacketMaxT(packet);
 		}
+		else
+		{
+			// Visit the child that the nearest ray enters first.
+			const BVHNode* nearChild = &nodes[node->leftFirst];
+			const BVHNode* farChild = nearChild + 1;
+			float nearDistance = IntersectAABBPacket(packet, *nearChild, maxT);
+			float farDistance = IntersectAABBPacket(packet, *farChild, maxT);
 
-		int partitionPlaneID = -1;
-		float lowestCost = INT_MAX;
+			if (nearDistance > farDistance)
+			{
+				std::swap(nearDistance, farDistance);
+				std::swap(nearChild, farChild);
+			}
 
-		// Evaluate which plane is the best split.
-		for (int j = 0; j < number_of_planes; j++)
-		{
-			float cost = trianglesLeft[j] * saBBleft[j] + trianglesRight[j] * saBBright[j];
-			if (cost < lowestCost && trianglesRight[j] > 0 && trianglesLeft[j] > 0)
+			if (nearDistance != numeric_limits<float>::max())
 			{
-				lowestCost = cost;
-				partitionPlaneID = j;
+				if (farDistance != numeric_limits<float>::max())
+				{
+					assert(stackPtr < STACKSIZE);
+					stack[stackPtr] = farChild;
+					stackDistance[stackPtr++] = farDistance;
+				}
+
+				node = nearChild;
+				continue;
 			}
 		}
 
-		if (partitionPlaneID == -1)
+		node = 0;
+		while (stackPtr > 0 && node == 0)
 		{
-			m_IsLeaf = true;
+			stackPtr--;
+			if (stackDistance[stackPtr] < maxT)
+			{
+				node = stack[stackPtr];
+			}
+		}
 
+		if (node == 0)
+		{
 			return;
 		}
+	}
+}
 
-		vector<CoreTri> leftPrimitives;
-		vector<CoreTri> rightPrimitives;
+//  +-----------------------------------------------------------------------------+
+//  |  BVH::IntersectAABBPacket                                                   |
+//  |  Returns the nearest distance at which a ray of the packet enters the box,  |
+//  |  or max float when no ray hits it before its current closest hit.           |
+//  +-----------------------------------------------------------------------------+
+float BVH::IntersectAABBPacket(const RayPacket& packet, const BVHNode& node, float tMax)
+{
+	// Interval arithmetic over the whole packet first; when that misses, so does every ray.
+	if (packet.coherent)
+	{
+		float entry = -numeric_limits<float>::max();
+		float exit = numeric_limits<float>::max();
+
+		const float bmin[3] = { node.minBounds.x, node.minBounds.y, node.minBounds.z };
+		const float bmax[3] = { node.maxBounds.x, node.maxBounds.y, node.maxBounds.z };
+		const float omin[3] = { packet.minOrigin.x, packet.minOrigin.y, packet.minOrigin.z };
+		const float omax[3] = { packet.maxOrigin.x, packet.maxOrigin.y, packet.maxOrigin.z };
+		const float rmin[3] = { packet.minRcpDirection.x, packet.minRcpDirection.y, packet.minRcpDirection.z };
+		const float rmax[3] = { packet.maxRcpDirection.x, packet.maxRcpDirection.y, packet.maxRcpDirection.z };
+
+		for (int axis = X; axis <= Z; axis++)
+		{
+			// All rays enter through the same slab plane and leave through the other.
+			float nearPlane = rmin[axis] > 0 ? bmin[axis] : bmax[axis];
+			float farPlane = rmin[axis] > 0 ? bmax[axis] : bmin[axis];
+
+			float n0 = nearPlane - omax[axis], n1 = nearPlane - omin[axis];
+			float f0 = farPlane - omax[axis], f1 = farPlane - omin[axis];
 
-		// Divide the primitives over left and right child with optimal split
-		for (uint i = 0; i < primitives.size(); i++)
+			entry = max(entry, min(min(n0 * rmin[axis], n0 * rmax[axis]), min(n1 * rmin[axis], n1 * rmax[axis])));
+			exit = min(exit, max(max(f0 * rmin[axis], f0 * rmax[axis]), max(f1 * rmin[axis], f1 * rmax[axis])));
+		}
+
+		exit *= BOX_EXIT_SCALE;
+		if (entry > exit || exit < 0 || entry >= tMax)
 		{
-			if (binID[i] <= partitionPlaneID)
-				leftPrimitives.push_back(primitives[i]);
-			else
-				rightPrimitives.push_back(primitives[i]);
+			return numeric_limits<float>::max();
 		}
-		
-		m_Left = new BVHNode();
-		m_Left->m_Root = this;
-		m_Left->primitives = leftPrimitives;
-		m_Left->bounds = CalculateVoxelBounds(leftPrimitives);
-		m_Left->Partition_Binned_SAH();
-
-		m_Right = new BVHNode();
-		m_Right->m_Root = this;
-		m_Right->primitives = rightPrimitives;
-		m_Right->bounds = CalculateVoxelBounds(rightPrimitives);
-		m_Right->Partition_Binned_SAH();
 	}
+
+	const __m256 miss = _mm256_set1_ps(numeric_limits<float>::max());
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 minX = _mm256_set1_ps(node.minBounds.x), maxX = _mm256_set1_ps(node.maxBounds.x);
+	const __m256 minY = _mm256_set1_ps(node.minBounds.y), maxY = _mm256_set1_ps(node.maxBounds.y);
+	const __m256 minZ = _mm256_set1_ps(node.minBounds.z), maxZ = _mm256_set1_ps(node.maxBounds.z);
+	__m256 nearest = miss;
+
+	for (int i = 0; i < RayPacket::SIZE; i += RayPacket::LANES)
+	{
+		__m256 ox = _mm256_load_ps(packet.ox + i), rdx = _mm256_load_ps(packet.rdx + i);
+		__m256 oy = _mm256_load_ps(packet.oy + i), rdy = _mm256_load_ps(packet.rdy + i);
+		__m256 oz = _mm256_load_ps(packet.oz + i), rdz = _mm256_load_ps(packet.rdz + i);
+
+		__m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(minX, ox), rdx);
+		__m256 tx2 = _mm256_mul_ps(_mm256_sub_ps(maxX, ox), rdx);
+		__m256 tmin = _mm256_min_ps(tx1, tx2);
+		__m256 tmax = _mm256_max_ps(tx1, tx2);
+
+		__m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(minY, oy), rdy);
+		__m256 ty2 = _mm256_mul_ps(_mm256_sub_ps(maxY, oy), rdy);
+		tmin = _mm256_max_ps(tmin, _mm256_min_ps(ty1, ty2));
+		tmax = _mm256_min_ps(tmax, _mm256_max_ps(ty1, ty2));
+
+		__m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(minZ, oz), rdz);
+		__m256 tz2 = _mm256_mul_ps(_mm256_sub_ps(maxZ, oz), rdz);
+		tmin = _mm256_max_ps(tmin, _mm256_min_ps(tz1, tz2));
+		tmax = _mm256_min_ps(tmax, _mm256_max_ps(tz1, tz2));
+
+		// Same conditions as IntersectAABB, per ray.
+		tmax = _mm256_mul_ps(tmax, _mm256_set1_ps(BOX_EXIT_SCALE));
+		__m256 hit = _mm256_and_ps(_mm256_cmp_ps(tmax, tmin, _CMP_GE_OQ), _mm256_cmp_ps(tmax, zero, _CMP_GE_OQ));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(tmin, _mm256_load_ps(packet.t + i), _CMP_LT_OQ));
+
+		nearest = _mm256_min_ps(nearest, _mm256_blendv_ps(miss, tmin, hit));
+	}
+
+	return HorizontalMin(nearest);
 }
 
-void BVHNode::Partition_SAH(float partitionScore)
+//  +-----------------------------------------------------------------------------+
+//  |  BVH::IntersectTrianglePacket                                               |
+//  |  The watertight test of BVH::IntersectTriangleGroup for all rays of the     |
+//  |  packet against one lane of a group, eight rays at a time, in the shear     |
+//  |  frame of the packet.                                                       |
+//  +-----------------------------------------------------------------------------+
+void BVH::IntersectTrianglePacket(RayPacket& packet, const TriangleGroup& group, int lane)
 {
-	// Current best area (lowest surface area).
-	float bestArea = partitionScore;
+	const int kx = packet.kx, ky = packet.ky, kz = packet.kz;
+	const float* origin[3] = { packet.ox, packet.oy, packet.oz };
+	const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+	const __m256 epsilon = _mm256_set1_ps(EPSILON), farLimit = _mm256_set1_ps(1 / EPSILON);
+	const __m256 index = _mm256_castsi256_ps(_mm256_set1_epi32(group.triIdx[lane]));
+	const __m256 sign = _mm256_set1_ps(-0.0f), error = _mm256_set1_ps(EDGE_FUNCTION_ERROR);
+
+	for (int i = 0; i < RayPacket::SIZE; i += RayPacket::LANES)
+	{
+		const __m256 ox = _mm256_load_ps(origin[kx] + i), oy = _mm256_load_ps(origin[ky] + i), oz = _mm256_load_ps(origin[kz] + i);
+		const __m256 Sx = _mm256_load_ps(packet.Sx + i), Sy = _mm256_load_ps(packet.Sy + i), Sz = _mm256_load_ps(packet.Sz + i);
+
+		// vertices relative to the ray origins, sheared so the rays run along z
+		const __m256 Az = _mm256_sub_ps(_mm256_set1_ps(group.v0[kz][lane]), oz);
+		const __m256 Bz = _mm256_sub_ps(_mm256_set1_ps(group.v1[kz][lane]), oz);
+		const __m256 Cz = _mm256_sub_ps(_mm256_set1_ps(group.v2[kz][lane]), oz);
+		const __m256 Ax = _mm256_sub_ps(_mm256_sub_ps(_mm256_set1_ps(group.v0[kx][lane]), ox), _mm256_mul_ps(Sx, Az));
+		const __m256 Ay = _mm256_sub_ps(_mm256_sub_ps(_mm256_set1_ps(group.v0[ky][lane]), oy), _mm256_mul_ps(Sy, Az));
+		const __m256 Bx = _mm256_sub_ps(_mm256_sub_ps(_mm256_set1_ps(group.v1[kx][lane]), ox), _mm256_mul_ps(Sx, Bz));
+		const __m256 By = _mm256_sub_ps(_mm256_sub_ps(_mm256_set1_ps(group.v1[ky][lane]), oy), _mm256_mul_ps(Sy, Bz));
+		const __m256 Cx = _mm256_sub_ps(_mm256_sub_ps(_mm256_set1_ps(group.v2[kx][lane]), ox), _mm256_mul_ps(Sx, Cz));
+		const __m256 Cy = _mm256_sub_ps(_mm256_sub_ps(_mm256_set1_ps(group.v2[ky][lane]), oy), _mm256_mul_ps(Sy, Cz));
+
+		__m256 U = _mm256_sub_ps(_mm256_mul_ps(Cx, By), _mm256_mul_ps(Cy, Bx));
+		__m256 V = _mm256_sub_ps(_mm256_mul_ps(Ax, Cy), _mm256_mul_ps(Ay, Cx));
+		__m256 W = _mm256_sub_ps(_mm256_mul_ps(Bx, Ay), _mm256_mul_ps(By, Ax));
+
+		__m256 inexact = _mm256_cmp_ps(_mm256_andnot_ps(sign, U), _mm256_mul_ps(error, _mm256_add_ps(_mm256_andnot_ps(sign, _mm256_mul_ps(Cx, By)), _mm256_andnot_ps(sign, _mm256_mul_ps(Cy, Bx)))), _CMP_LE_OQ);
+		inexact = _mm256_or_ps(inexact, _mm256_cmp_ps(_mm256_andnot_ps(sign, V), _mm256_mul_ps(error, _mm256_add_ps(_mm256_andnot_ps(sign, _mm256_mul_ps(Ax, Cy)), _mm256_andnot_ps(sign, _mm256_mul_ps(Ay, Cx)))), _CMP_LE_OQ));
+		inexact = _mm256_or_ps(inexact, _mm256_cmp_ps(_mm256_andnot_ps(sign, W), _mm256_mul_ps(error, _mm256_add_ps(_mm256_andnot_ps(sign, _mm256_mul_ps(Bx, Ay)), _mm256_andnot_ps(sign, _mm256_mul_ps(By, Ax)))), _CMP_LE_OQ));
+
+		if (int mask = _mm256_movemask_ps(inexact))
+		{
+			alignas(32) float ax[8], ay[8], bx[8], by[8], cx[8], cy[8], eu[8], ev[8], ew[8];
+			_mm256_store_ps(ax, Ax), _mm256_store_ps(ay, Ay), _mm256_store_ps(bx, Bx), _mm256_store_ps(by, By), _mm256_store_ps(cx, Cx), _mm256_store_ps(cy, Cy);
+			_mm256_store_ps(eu, U), _mm256_store_ps(ev, V), _mm256_store_ps(ew, W);
+			RefineEdgeFunctions(mask, ax, ay, bx, by, cx, cy, eu, ev, ew);
+			U = _mm256_load_ps(eu), V = _mm256_load_ps(ev), W = _mm256_load_ps(ew);
+		}
+
+		const __m256 negative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(U, zero, _CMP_LT_OQ), _mm256_cmp_ps(V, zero, _CMP_LT_OQ)), _mm256_cmp_ps(W, zero, _CMP_LT_OQ));
+		const __m256 positive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(U, zero, _CMP_GT_OQ), _mm256_cmp_ps(V, zero, _CMP_GT_OQ)), _mm256_cmp_ps(W, zero, _CMP_GT_OQ));
+		const __m256 det = _mm256_add_ps(_mm256_add_ps(U, V), W);
 
-	// The primitives that give the best area.
-	vector<CoreTri> bestObjectsLeft;
-	vector<CoreTri> bestObjectsRight;
+		const __m256 T = _mm256_mul_ps(Sz, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(U, Az), _mm256_mul_ps(V, Bz)), _mm256_mul_ps(W, Cz)));
+		const __m256 rcpDet = _mm256_div_ps(one, det);
+		const __m256 t = _mm256_mul_ps(T, rcpDet);
 
-	// Here we consider the centroid of each primitive as potential split.
-	for (auto& primitive : primitives)
+		__m256 closest = _mm256_load_ps(packet.t + i);
+		__m256 hit = _mm256_andnot_ps(_mm256_and_ps(negative, positive), _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+		hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(t, epsilon, _CMP_GT_OQ), _mm256_cmp_ps(t, farLimit, _CMP_LT_OQ)));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, closest, _CMP_LT_OQ));
+
+		_mm256_store_ps(packet.t + i, _mm256_blendv_ps(closest, t, hit));
+		_mm256_store_ps((float*)packet.triIdx + i, _mm256_blendv_ps(_mm256_load_ps((float*)packet.triIdx + i), index, hit));
+		_mm256_store_ps(packet.u + i, _mm256_blendv_ps(_mm256_load_ps(packet.u + i), _mm256_mul_ps(V, rcpDet), hit));
+		_mm256_store_ps(packet.v + i, _mm256_blendv_ps(_mm256_load_ps(packet.v + i), _mm256_mul_ps(W, rcpDet), hit));
+	}
+}
+
+float BVH::PacketMaxT(const RayPacket& packet)
+{
+	__m256 maxT = _mm256_load_ps(packet.t);
+	for (int i = RayPacket::LANES; i < RayPacket::SIZE; i += RayPacket::LANES)
 	{
-		// Potential split.
-		float3 split = CalculateTriangleCentroid(primitive.vertex0, primitive.vertex1, primitive.vertex2);
+		maxT = _mm256_max_ps(maxT, _mm256_load_ps(packet.t + i));
+	}
+
+	return HorizontalMax(maxT);
+}
+
+void BVH::ConstructBVH(Mesh& mesh, tf::Executor* executor)
+{
+	triangles = mesh.triangles;
 
-		bestArea = CalculateBestArea(split, bestObjectsRight, bestObjectsLeft);
+	vector<AABB> bounds(mesh.vcount / 3);
+	for (size_t i = 0; i < bounds.size(); i++)
+	{
+		bounds[i] = CalculateTriangleBounds(triangles[i]);
 	}
 
-	// Make children if this is the root node.
-	// Or make children when the current partitionScore is better than parent node.
-	if (bestArea <= partitionScore) {
-		m_Left = new BVHNode();
-		m_Right = new BVHNode();
+	ConstructBVH(move(bounds), executor);
+	BuildTriangleGroups();
+}
 
-		m_Left->primitives = bestObjectsLeft;
-		m_Right->primitives = bestObjectsRight;
+//  +-----------------------------------------------------------------------------+
+//  |  BVH::ConstructBVH                                                          |
+//  |  Builds the tree over arbitrary primitives, given only their bounds. Leaf   |
+//  |  entries in triIdx index into the supplied array.                           |
+//  +-----------------------------------------------------------------------------+
+void BVH::ConstructBVH(vector<AABB> bounds, tf::Executor* executor)
+{
+	triangleCount = (int)bounds.size();
+	primBounds = move(bounds);
 
-		m_Left->bounds = CalculateVoxelBounds(m_Left->primitives);
-		m_Left->Partition_SAH(partitionScore);
+	// A binary tree with N leaves has at most 2N - 1 nodes.
+	nodes.resize(max(1, 2 * triangleCount - 1));
+	triIdx.resize(triangleCount);
+	centroids.resize(triangleCount);
 
-		m_Right->bounds = CalculateVoxelBounds(m_Right->primitives);
-		m_Right->Partition_SAH(partitionScore);
+	for (int i = 0; i < triangleCount; i++)
+	{
+		triIdx[i] = i;
+		centroids[i] = CalculateBoundingBoxCenter(primBounds[i]);
+	}
+
+	BVHNode& root = nodes[0];
+	root.leftFirst = 0;
+	root.count = triangleCount;
+	nodesUsed = 1;
+
+	UpdateNodeBounds(0);
+
+	if (executor == 0 || executor->num_workers() < 2 || triangleCount < PARALLEL_BUILD_THRESHOLD)
+	{
+		Partition_Binned_SAH(nodes, nodesUsed, 0, 0);
 	}
 	else
 	{
-		m_IsLeaf = true;
+		ConstructParallel(*executor);
+	}
+
+	// Hand back what we reserved but did not use, and the build-time data.
+	nodes.resize(nodesUsed);
+	nodes.shrink_to_fit();
+	vector<AABB>().swap(primBounds);
+	vector<float3>().swap(centroids);
+
+	buildCost = CalculateSAHCost();
+
+	if (wide)
+	{
+		CollapseToBVH4();
 	}
 }
 
-float3 BVHNode::CalculateBoundingBoxCenter(AABB boundingBox) {
-	float centerX = boundingBox.minBounds.x + ((boundingBox.maxBounds.x - boundingBox.minBounds.x) / 2);
-	float centerY = boundingBox.minBounds.y + ((boundingBox.maxBounds.y - boundingBox.minBounds.y) / 2);
-	float centerZ = boundingBox.minBounds.z + ((boundingBox.maxBounds.z - boundingBox.minBounds.z) / 2);
-	
-	return make_float3(centerX, centerY, centerZ);
+//  +-----------------------------------------------------------------------------+
+//  |  BVH::Refit                                                                 |
+//  |  Recomputes all node bounds after the triangles moved, keeping the tree     |
+//  |  structure. Children are always stored after their parent, so a single      |
+//  |  backwards pass over the nodes updates them bottom-up. Returns false when   |
+//  |  the tree has degraded so much that it should be rebuilt instead.           |
+//  +-----------------------------------------------------------------------------+
+bool BVH::Refit()
+{
+	if (triangleCount == 0 || triangles == 0)
+	{
+		return true;
+	}
+
+	for (int i = nodesUsed - 1; i >= 0; i--)
+	{
+		BVHNode& node = nodes[i];
+
+		if (node.IsLeaf())
+		{
+			AABB bounds;
+			for (int j = node.leftFirst; j < node.leftFirst + node.count; j++)
+			{
+				AABB tb = CalculateTriangleBounds(triangles[triIdx[j]]);
+				bounds.minBounds = fminf(bounds.minBounds, tb.minBounds);
+				bounds.maxBounds = fmaxf(bounds.maxBounds, tb.maxBounds);
+			}
+
+			node.minBounds = bounds.minBounds;
+			node.maxBounds = bounds.maxBounds;
+		}
+		else
+		{
+			const BVHNode& left = nodes[node.leftFirst];
+			const BVHNode& right = nodes[node.leftFirst + 1];
+
+			node.minBounds = fminf(left.minBounds, right.minBounds);
+			node.maxBounds = fmaxf(left.maxBounds, right.maxBounds);
+		}
+	}
+
+	BuildTriangleGroups();
+
+	if (wide)
+	{
+		CollapseToBVH4();
+	}
+
+	return CalculateSAHCost() <= buildCost * REFIT_DEGRADATION_LIMIT;
 }
 
-AABB BVHNode::CalculateTriangleBounds(CoreTri& triangle)
+//  +-----------------------------------------------------------------------------+
+//  |  BVH::BuildTriangleGroups                                                   |
+//  |  Packs the triangles of every leaf into TriangleGroups, in the order of     |
+//  |  triIdx, so traversal tests up to four triangles per step from one          |
+//  |  contiguous block.                                                          |
+//  +-----------------------------------------------------------------------------+
+void BVH::BuildTriangleGroups()
 {
-	float3 minBoxBounds = make_float3(numeric_limits<float>::max(), numeric_limits<float>::max(), numeric_limits<float>::max());
-	float3 maxBoxBounds = make_float3(-numeric_limits<float>::max(), -numeric_limits<float>::max(), -numeric_limits<float>::max());
+	triangleGroups.clear();
+	groupFirst.assign(triangleCount, -1);
 
-	float3 vertex0 = triangle.vertex0;
-	float3 vertex1 = triangle.vertex1;
-	float3 vertex2 = triangle.vertex2;
+	for (int i = 0; i < nodesUsed; i++)
+	{
+		const BVHNode& node = nodes[i];
+		if (!node.IsLeaf())
+		{
+			continue;
+		}
 
-	float3 primMin = fminf(fminf(vertex0, vertex1), vertex2);
-	float3 primMax = fmaxf(fmaxf(vertex0, vertex1), vertex2);
+		groupFirst[node.leftFirst] = (int)triangleGroups.size();
 
-	minBoxBounds = fminf(minBoxBounds, primMin);
-	maxBoxBounds = fmaxf(maxBoxBounds, primMax);
+		for (int first = 0; first < node.count; first += 4)
+		{
+			TriangleGroup group = {};
 
-	AABB aabb{};
-	aabb.minBounds = minBoxBounds;
-	aabb.maxBounds = maxBoxBounds;
+			for (int lane = 0; lane < 4; lane++)
+			{
+				// unused lanes repeat the first triangle of the group
+				const int entry = first + lane < node.count ? first + lane : first;
+				const uint idx = triIdx[node.leftFirst + entry];
+				const CoreTri& tri = triangles[idx];
+
+				group.v0[X][lane] = tri.vertex0.x, group.v0[Y][lane] = tri.vertex0.y, group.v0[Z][lane] = tri.vertex0.z;
+				group.v1[X][lane] = tri.vertex1.x, group.v1[Y][lane] = tri.vertex1.y, group.v1[Z][lane] = tri.vertex1.z;
+				group.v2[X][lane] = tri.vertex2.x, group.v2[Y][lane] = tri.vertex2.y, group.v2[Z][lane] = tri.vertex2.z;
+				group.triIdx[lane] = (int)idx;
+			}
 
-	return aabb;
+			triangleGroups.push_back(group);
+		}
+	}
 }
 
-AABB BVHNode::CalculateVoxelBounds(vector<CoreTri> &triangles)
+//  +-----------------------------------------------------------------------------+
+//  |  BVH::CalculateSAHCost                                                      |
+//  |  Expected cost of tracing a ray through the tree, relative to the root.     |
+//  +-----------------------------------------------------------------------------+
+float BVH::CalculateSAHCost()
 {
-	float3 minBoxBounds = make_float3(numeric_limits<float>::max(), numeric_limits<float>::max(), numeric_limits<float>::max());
-	float3 maxBoxBounds = make_float3(-numeric_limits<float>::max(), -numeric_limits<float>::max(), -numeric_limits<float>::max());
+	float rootArea = CalculateSurfaceArea(AABB(nodes[0].minBounds, nodes[0].maxBounds));
 
-	int size = triangles.size();
+	if (triangleCount == 0 || rootArea <= 0)
+	{
+		return 0;
+	}
 
-	for (int i = 0; i < size; i++)
+	float cost = 0;
+	for (int i = 0; i < nodesUsed; i++)
 	{
-		float3 vertex0 = triangles[i].vertex0;
-		float3 vertex1 = triangles[i].vertex1;
-		float3 vertex2 = triangles[i].vertex2;
+		const BVHNode& node = nodes[i];
+		float area = CalculateSurfaceArea(AABB(node.minBounds, node.maxBounds));
+		cost += node.IsLeaf() ? INTERSECTION_COST * node.count * area : TRAVERSAL_COST * area;
+	}
 
-		float3 primMin = fminf(fminf(vertex0, vertex1), vertex2);
-		float3 primMax = fmaxf(fmaxf(vertex0, vertex1), vertex2);
+	return cost / rootArea;
+}
 
-		minBoxBounds = fminf(minBoxBounds, primMin);
-		maxBoxBounds = fmaxf(maxBoxBounds, primMax);
-	}
+//  +-----------------------------------------------------------------------------+
+//  |  BVH::ConstructParallel                                                     |
+//  |  Splits the top of the tree with parallel binning until nodes are small     |
+//  |  enough to be built as independent subtrees, builds those as tasks, and     |
+//  |  finally lays all nodes out in the order the sequential build would have    |
+//  |  produced. Split decisions do not depend on how the work was divided, so    |
+//  |  the result is identical to a sequential build.                             |
+//  +-----------------------------------------------------------------------------+
+void BVH::ConstructParallel(tf::Executor& executor)
+{
+	int subtreeSize = max(SUBTREE_MIN_SIZE, triangleCount / (int)(8 * executor.num_workers()));
 
-	AABB aabb{};
-	aabb.minBounds = minBoxBounds;
-	aabb.maxBounds = maxBoxBounds;
+	vector<BVHNode> top(1, nodes[0]);
+	vector<BVHSubtree> subtrees;
+	SubdivideTopLevel(top, 0, 0, subtrees, subtreeSize, executor);
 
-	return aabb;
+	tf::Taskflow taskflow;
+	for (BVHSubtree& subtree : subtrees)
+	{
+		taskflow.emplace([this, &subtree]()
+		{
+			subtree.nodes.resize(2 * subtree.root.count - 1);
+			subtree.nodes[0] = subtree.root;
+			subtree.nodesUsed = 1;
+			Partition_Binned_SAH(subtree.nodes, subtree.nodesUsed, 0, subtree.depth);
+		});
+	}
+	executor.run(taskflow).wait();
+
+	nodesUsed = 1;
+	EmitNodes(top, 0, 0, subtrees);
 }
 
-float3 BVHNode::CalculateTriangleCentroid(float3 vertex0, float3 vertex1, float3 vertex2)
+void BVH::SubdivideTopLevel(vector<BVHNode>& top, int nodeIdx, int depth, vector<BVHSubtree>& subtrees, int subtreeSize, tf::Executor& executor)
 {
-	return vertex0 + vertex1 + vertex2 / 3.0f;
+	BVHNode node = top[nodeIdx];
+
+	if (node.count <= subtreeSize)
+	{
+		// Defer to a build task; a negative count refers to the subtree.
+		BVHSubtree subtree;
+		subtree.root = node;
+		subtree.depth = depth;
+		subtrees.push_back(subtree);
+		top[nodeIdx].count = -(int)subtrees.size();
+		return;
+	}
+
+	BVHSplit split;
+	if (depth >= MAXDEPTH || !FindBestSplit(node, split, &executor))
+	{
+		return;
+	}
+
+	int rightFirst = PartitionPrimitives(node.leftFirst, node.count, split);
+	int leftIdx = (int)top.size();
+
+	BVHNode left, right;
+	left.minBounds = split.left.minBounds;
+	left.maxBounds = split.left.maxBounds;
+	left.leftFirst = node.leftFirst;
+	left.count = rightFirst - node.leftFirst;
+	right.minBounds = split.right.minBounds;
+	right.maxBounds = split.right.maxBounds;
+	right.leftFirst = rightFirst;
+	right.count = node.count - left.count;
+
+	top.push_back(left);
+	top.push_back(right);
+	top[nodeIdx].leftFirst = leftIdx;
+	top[nodeIdx].count = 0;
+
+	SubdivideTopLevel(top, leftIdx, depth + 1, subtrees, subtreeSize, executor);
+	SubdivideTopLevel(top, leftIdx + 1, depth + 1, subtrees, subtreeSize, executor);
 }
 
-float BVHNode::CalculateSurfaceArea(AABB bounds) 
+void BVH::EmitNodes(const vector<BVHNode>& pool, int srcIdx, int dstIdx, const vector<BVHSubtree>& subtrees)
 {
-	float3 box = bounds.maxBounds - bounds.minBounds;
-	return (2 * box.x * box.y + 2 * box.y * box.z + 2 * box.z * box.x);
+	const BVHNode& node = pool[srcIdx];
+
+	if (node.count < 0)
+	{
+		EmitNodes(subtrees[-node.count - 1].nodes, 0, dstIdx, subtrees);
+		return;
+	}
+
+	nodes[dstIdx] = node;
+
+	if (!node.IsLeaf())
+	{
+		// Same allocation order as Partition_Binned_SAH: both children, then the left subtree.
+		int leftIdx = nodesUsed;
+		nodesUsed += 2;
+		nodes[dstIdx].leftFirst = leftIdx;
+
+		EmitNodes(pool, node.leftFirst, leftIdx, subtrees);
+		EmitNodes(pool, node.leftFirst + 1, leftIdx + 1, subtrees);
+	}
 }
 
-float BVHNode::CalculateBestArea(float3 splitPoint, vector<CoreTri> &bestObjectsRight, vector<CoreTri>& bestObjectsLeft)
+void BVH::Partition_Binned_SAH(vector<BVHNode>& pool, int& poolUsed, int nodeIdx, int depth)
 {
-	float bestArea = numeric_limits<float>::max();
+	BVHNode& node = pool[nodeIdx];
 
-	// Keep track of the number of primitives divided over left and right
-	// for the current split over three axes.
-	float3 leftPrimitives = make_float3(0);
-	float3 rightPrimitives = make_float3(0);
+	BVHSplit split;
+	if (depth >= MAXDEPTH || !FindBestSplit(node, split, 0))
+	{
+		return;
+	}
+
+	int rightFirst = PartitionPrimitives(node.leftFirst, node.count, split);
+	int leftIdx = poolUsed++;
+	int rightIdx = poolUsed++;
+
+	pool[leftIdx].leftFirst = node.leftFirst;
+	pool[leftIdx].count = rightFirst - node.leftFirst;
+	pool[leftIdx].minBounds = split.left.minBounds;
+	pool[leftIdx].maxBounds = split.left.maxBounds;
+	pool[rightIdx].leftFirst = rightFirst;
+	pool[rightIdx].count = node.count - pool[leftIdx].count;
+	pool[rightIdx].minBounds = split.right.minBounds;
+	pool[rightIdx].maxBounds = split.right.maxBounds;
 
-	vector<CoreTri> objectsRightX;
-	vector<CoreTri> objectsLeftX;
-	vector<CoreTri> objectsRightY;
-	vector<CoreTri> objectsLeftY;
-	vector<CoreTri> objectsRightZ;
-	vector<CoreTri> objectsLeftZ;
+	node.leftFirst = leftIdx;
+	node.count = 0;
 
-	// Divide the other primitives over the split
-	for (auto& primitive : primitives)
+	Partition_Binned_SAH(pool, poolUsed, leftIdx, depth + 1);
+	Partition_Binned_SAH(pool, poolUsed, rightIdx, depth + 1);
+}
+
+bool BVH::FindBestSplit(const BVHNode& node, BVHSplit& split, tf::Executor* executor)
+{
+	if (node.count < 2)
 	{
-		float3 centroid = CalculateTriangleCentroid(primitive.vertex0, primitive.vertex1, primitive.vertex2);
+		return false;
+	}
 
-		if (centroid.x <= splitPoint.x)
-		{
-			leftPrimitives.x++;
+	int first = node.leftFirst;
+	int last = node.leftFirst + node.count;
+
+	// Large nodes are binned in chunks by all workers. Bins only hold counts and
+	// min/max bounds, so merging the chunks gives exactly the sequential result.
+	bool parallel = executor != 0 && node.count >= PARALLEL_BINNING_THRESHOLD;
+	int chunkCount = parallel ? (int)executor->num_workers() : 1;
+	int chunkSize = (node.count + chunkCount - 1) / chunkCount;
+
+	// Per-chunk results. The sequential path, which runs for every small node, keeps them
+	// on the stack; only parallel binning allocates one entry per worker.
+	AABB localBounds;
+	BVHBins localBins;
+	vector<AABB> parallelBounds;
+	vector<BVHBins> parallelBins;
+	if (parallel)
+	{
+		parallelBounds.resize(chunkCount);
+		parallelBins.resize(chunkCount);
+	}
 
-			objectsLeftX.push_back(primitive);
-		}
-		else
-		{
-			rightPrimitives.x++;
+	AABB* chunkBounds = parallel ? parallelBounds.data() : &localBounds;
+	BVHBins* chunkBins = parallel ? parallelBins.data() : &localBins;
 
-			objectsRightX.push_back(primitive);
-		}
-		if (centroid.y <= splitPoint.y)
+	auto forEachChunk = [&](auto&& work)
+	{
+		if (!parallel)
 		{
-			leftPrimitives.y++;
+			work(0, first, last);
+			return;
+		}
 
-			objectsLeftY.push_back(primitive);
+		tf::Taskflow taskflow;
+		for (int c = 0; c < chunkCount; c++)
+		{
+			int chunkFirst = first + c * chunkSize;
+			int chunkLast = min(last, chunkFirst + chunkSize);
+			taskflow.emplace([&work, c, chunkFirst, chunkLast]() { work(c, chunkFirst, chunkLast); });
 		}
-		else
+		executor->run(taskflow).wait();
+	};
+
+	// The bounding box for all centroids.
+	forEachChunk([&](int c, int chunkFirst, int chunkLast) { chunkBounds[c] = CalculateCentroidBounds(chunkFirst, chunkLast); });
+
+	AABB cb = chunkBounds[0];
+	for (int c = 1; c < chunkCount; c++)
+	{
+		cb.minBounds = fminf(cb.minBounds, chunkBounds[c].minBounds);
+		cb.maxBounds = fmaxf(cb.maxBounds, chunkBounds[c].maxBounds);
+	}
+
+	float minCentroid[3] = { cb.minBounds.x, cb.minBounds.y, cb.minBounds.z };
+	float extent[3] = { cb.maxBounds.x - cb.minBounds.x, cb.maxBounds.y - cb.minBounds.y, cb.maxBounds.z - cb.minBounds.z };
+
+	for (int axis = X; axis <= Z; axis++)
+	{
+		split.minCentroid[axis] = minCentroid[axis];
+		split.k[axis] = extent[axis] > 0 ? binCount * (1 - EPSILON) / extent[axis] : 0;
+	}
+
+	// Count the number of primitives in each bin, for all three axes at once.
+	forEachChunk([&](int c, int chunkFirst, int chunkLast) { BinPrimitives(chunkFirst, chunkLast, split, chunkBins[c]); });
+
+	BVHBins& bins = chunkBins[0];
+	for (int c = 1; c < chunkCount; c++)
+	{
+		for (int axis = X; axis <= Z; axis++)
 		{
-			rightPrimitives.y++;
+			for (int j = 0; j < binCount; j++)
+			{
+				bins.count[axis][j] += chunkBins[c].count[axis][j];
+				bins.bounds[axis][j].minBounds = fminf(bins.bounds[axis][j].minBounds, chunkBins[c].bounds[axis][j].minBounds);
+				bins.bounds[axis][j].maxBounds = fmaxf(bins.bounds[axis][j].maxBounds, chunkBins[c].bounds[axis][j].maxBounds);
+			}
+		}
+	}
 
-			objectsRightY.push_back(primitive);
+	// plane[j] will have bin[0..j] on the left and bin[j+1..] to the right.
+	int numberOfPlanes = binCount - 1;
+	float lowestCost = numeric_limits<float>::max();
+
+	for (int axis = X; axis <= Z; axis++)
+	{
+		if (split.k[axis] == 0)
+		{
+			continue;
 		}
-		if (centroid.z <= splitPoint.z)
+
+		// Number of triangles on the left side of the plane.
+		int trianglesLeft[MAXBINS];
+		// Bounding box on the left side of the plane and its surface area.
+		AABB bbLeft[MAXBINS];
+		float saBBleft[MAXBINS];
+
+		int numberOfTrianglesLeft = 0;
+		AABB bb;
+		for (int j = 0; j < numberOfPlanes; j++)
 		{
-			leftPrimitives.z++;
+			numberOfTrianglesLeft += bins.count[axis][j];
+			trianglesLeft[j] = numberOfTrianglesLeft;
 
-			objectsLeftZ.push_back(primitive);
+			bb.minBounds = fminf(bb.minBounds, bins.bounds[axis][j].minBounds);
+			bb.maxBounds = fmaxf(bb.maxBounds, bins.bounds[axis][j].maxBounds);
+			bbLeft[j] = bb;
+			saBBleft[j] = numberOfTrianglesLeft > 0 ? CalculateSurfaceArea(bb) : 0;
 		}
-		else
+
+		// Sweep back from the right and evaluate every plane on the way.
+		int numberOfTrianglesRight = 0;
+		AABB bbRight;
+		for (int j = numberOfPlanes - 1; j >= 0; j--)
 		{
-			rightPrimitives.z++;
+			numberOfTrianglesRight += bins.count[axis][j + 1];
+
+			bbRight.minBounds = fminf(bbRight.minBounds, bins.bounds[axis][j + 1].minBounds);
+			bbRight.maxBounds = fmaxf(bbRight.maxBounds, bins.bounds[axis][j + 1].maxBounds);
 
-			objectsRightZ.push_back(primitive);
+			if (trianglesLeft[j] == 0 || numberOfTrianglesRight == 0)
+			{
+				continue;
+			}
+
+			float cost = trianglesLeft[j] * saBBleft[j] + numberOfTrianglesRight * CalculateSurfaceArea(bbRight);
+			if (cost < lowestCost)
+			{
+				lowestCost = cost;
+				split.axis = axis;
+				split.plane = j;
+				split.left = bbLeft[j];
+				split.right = bbRight;
+			}
 		}
 	}
 
-	// Calculate the surface area with the current made splits over all axes.
-	float currentAreaX = CalculateSurfaceArea(CalculateVoxelBounds(objectsLeftX)) * leftPrimitives.x +
-		CalculateSurfaceArea(CalculateVoxelBounds(objectsRightX)) * rightPrimitives.x;
-	float currentAreaY = CalculateSurfaceArea(CalculateVoxelBounds(objectsLeftY)) * leftPrimitives.y +
-		CalculateSurfaceArea(CalculateVoxelBounds(objectsRightY)) * rightPrimitives.y;
-	float currentAreaZ = CalculateSurfaceArea(CalculateVoxelBounds(objectsLeftZ)) * leftPrimitives.z +
-		CalculateSurfaceArea(CalculateVoxelBounds(objectsRightZ)) * rightPrimitives.z;
+	// Only split when the children are expected to be cheaper to trace than this node as a leaf.
+	float area = CalculateSurfaceArea(AABB(node.minBounds, node.maxBounds));
+	float leafCost = INTERSECTION_COST * node.count * area;
+	float splitCost = TRAVERSAL_COST * area + INTERSECTION_COST * lowestCost;
 
-	if (currentAreaX < bestArea && isnan(currentAreaX) == false)
+	return split.axis != -1 && splitCost < leafCost;
+}
+
+AABB BVH::CalculateCentroidBounds(int first, int last)
+{
+	AABB cb{ make_float3(INT_MAX) , make_float3(INT_MIN) };
+
+	for (int i = first; i < last; i++)
 	{
-		bestObjectsRight = objectsRightX;
-		bestObjectsLeft = objectsLeftX;
-		bestArea = currentAreaX;
+		cb.minBounds = fminf(centroids[triIdx[i]], cb.minBounds);
+		cb.maxBounds = fmaxf(centroids[triIdx[i]], cb.maxBounds);
 	}
-	if (currentAreaY < bestArea && isnan(currentAreaY) == false)
+
+	return cb;
+}
+
+void BVH::BinPrimitives(int first, int last, const BVHSplit& split, BVHBins& bins)
+{
+	for (int i = first; i < last; i++)
 	{
-		bestObjectsRight = objectsRightY;
-		bestObjectsLeft = objectsLeftY;
-		bestArea = currentAreaY;
+		const AABB& tb = primBounds[triIdx[i]];
+
+		for (int axis = X; axis <= Z; axis++)
+		{
+			// Assign the primitive to the appropriate bin.
+			int id = BinOf(triIdx[i], split, axis);
+
+			bins.count[axis][id]++;
+			bins.bounds[axis][id].minBounds = fminf(bins.bounds[axis][id].minBounds, tb.minBounds);
+			bins.bounds[axis][id].maxBounds = fmaxf(bins.bounds[axis][id].maxBounds, tb.maxBounds);
+		}
 	}
-	if (currentAreaZ < bestArea && isnan(currentAreaZ) == false)
+}
+
+int BVH::BinOf(uint primitive, const BVHSplit& split, int axis)
+{
+	const float3& c = centroids[primitive];
+	float position = axis == X ? c.x : axis == Y ? c.y : c.z;
+	return min(binCount - 1, (int)(split.k[axis] * (position - split.minCentroid[axis])));
+}
+
+int BVH::PartitionPrimitives(int first, int count, const BVHSplit& split)
+{
+	// Divide the primitives over left and right child in place.
+	int i = first;
+	int j = first + count - 1;
+	while (i <= j)
 	{
-		bestObjectsRight = objectsRightZ;
-		bestObjectsLeft = objectsLeftZ;
-		bestArea = currentAreaZ;
+		if (BinOf(triIdx[i], split, split.axis) <= split.plane)
+			i++;
+		else
+			std::swap(triIdx[i], triIdx[j--]);
 	}
 
-	return bestArea;
+	return i;
+}
+
+void BVH::UpdateNodeBounds(int nodeIdx)
+{
+	BVHNode& node = nodes[nodeIdx];
+
+	float3 minBoxBounds = make_float3(numeric_limits<float>::max(), numeric_limits<float>::max(), numeric_limits<float>::max());
+	float3 maxBoxBounds = make_float3(-numeric_limits<float>::max(), -numeric_limits<float>::max(), -numeric_limits<float>::max());
+
+	for (int i = node.leftFirst; i < node.leftFirst + node.count; i++)
+	{
+		minBoxBounds = fminf(minBoxBounds, primBounds[triIdx[i]].minBounds);
+		maxBoxBounds = fmaxf(maxBoxBounds, primBounds[triIdx[i]].maxBounds);
+	}
+
+	node.minBounds = minBoxBounds;
+	node.maxBounds = maxBoxBounds;
+}
+
+float3 BVH::CalculateBoundingBoxCenter(AABB boundingBox) {
+	float centerX = boundingBox.minBounds.x + ((boundingBox.maxBounds.x - boundingBox.minBounds.x) / 2);
+	float centerY = boundingBox.minBounds.y + ((boundingBox.maxBounds.y - boundingBox.minBounds.y) / 2);
+	float centerZ = boundingBox.minBounds.z + ((boundingBox.maxBounds.z - boundingBox.minBounds.z) / 2);
+
+	return make_float3(centerX, centerY, centerZ);
+}
+
+AABB BVH::CalculateTriangleBounds(const CoreTri& triangle)
+{
+	float3 vertex0 = triangle.vertex0;
+	float3 vertex1 = triangle.vertex1;
+	float3 vertex2 = triangle.vertex2;
+
+	AABB aabb{};
+	aabb.minBounds = fminf(fminf(vertex0, vertex1), vertex2);
+	aabb.maxBounds = fmaxf(fmaxf(vertex0, vertex1), vertex2);
+
+	return aabb;
+}
+
+float BVH::CalculateSurfaceArea(AABB bounds)
+{
+	float3 box = bounds.maxBounds - bounds.minBounds;
+	return (2 * box.x * box.y + 2 * box.y * box.z + 2 * box.z * box.x);
 }
@@ -1,31 +1,200 @@
 #pragma once
-#include "rendersystem.h""
+#include "platform.h"
+#include "rendersystem.h"
 #include "AABB.h"
 #include "Ray.h"
+#include "RayPacket.h"
 #include "Mesh.h"
 using namespace lighthouse2;
 
-class BVHNode
+//  +-----------------------------------------------------------------------------+
+//  |  BVHNode                                                                    |
+//  |  Compact 32-byte node. For interior nodes leftFirst is the index of the     |
+//  |  left child; the right child is always stored directly after it. For        |
+//  |  leaves leftFirst is the first entry in BVH::triIdx, count the number of    |
+//  |  primitives. Interior nodes have a count of 0.                              |
+//  +-----------------------------------------------------------------------------+
+struct BVHNode
+{
+	float3 minBounds;
+	int leftFirst;
+	float3 maxBounds;
+	int count;
+
+	bool IsLeaf() const { return count > 0; }
+};
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode should be exactly 32 bytes");
+
+//  +-----------------------------------------------------------------------------+
+//  |  BVH4Node                                                                   |
+//  |  Node of the 4-wide BVH, with the bounds of its children stored per axis    |
+//  |  so one SSE slab test covers all four. A child with count > 0 is a leaf     |
+//  |  and child is its first entry in BVH::triIdx; otherwise child is the index  |
+//  |  of a BVH4Node. Unused slots have bounds at infinity, which no ray hits.    |
+//  +-----------------------------------------------------------------------------+
+struct alignas(64) BVH4Node
+{
+	float minX[4], minY[4], minZ[4];
+	float maxX[4], maxY[4], maxZ[4];
+	int child[4];
+	int count[4];
+};
+
+//  +-----------------------------------------------------------------------------+
+//  |  TriangleGroup                                                              |
+//  |  Intersection data of up to four triangles of a leaf in SoA layout, so a    |
+//  |  triangle test does not touch the 208-byte CoreTri. Vertices are stored     |
+//  |  rather than edges: the watertight test needs neighbouring triangles to     |
+//  |  see exactly the same coordinates for a shared edge. Unused lanes repeat    |
+//  |  the first triangle of the group, so they never report a different hit.     |
+//  +-----------------------------------------------------------------------------+
+struct alignas(16) TriangleGroup
+{
+	// Vertex coordinates per axis: v0[axis][lane].
+	float v0[3][4], v1[3][4], v2[3][4];
+	int triIdx[4];
+};
+
+//  +-----------------------------------------------------------------------------+
+//  |  BVHBins                                                                    |
+//  |  Primitive counts and bounds per SAH bin, for all three axes.               |
+//  +-----------------------------------------------------------------------------+
+struct BVHBins
+{
+	static constexpr int MAXBINS = 32;
+
+	int count[3][MAXBINS] = {};
+	AABB bounds[3][MAXBINS];
+};
+
+//  +-----------------------------------------------------------------------------+
+//  |  BVHSplit                                                                   |
+//  |  Binning setup of a node and the best split plane found for it.             |
+//  +-----------------------------------------------------------------------------+
+struct BVHSplit
+{
+	// Bins per unit of distance along each axis; 0 where all centroids coincide.
+	float k[3];
+	float minCentroid[3];
+	int axis = -1;
+	int plane = -1;
+	// Bounds of the left and right child.
+	AABB left, right;
+};
+
+//  +-----------------------------------------------------------------------------+
+//  |  BVHSubtree                                                                 |
+//  |  Part of the tree that is built by a single task during parallel            |
+//  |  construction, in its own node pool.                                        |
+//  +-----------------------------------------------------------------------------+
+struct BVHSubtree
+{
+	BVHNode root;
+	// Depth of the root in the complete tree.
+	int depth = 0;
+	vector<BVHNode> nodes;
+	int nodesUsed = 0;
+	// SAH cost of the tree right after construction.
+	float buildCost = 0;
+};
+
+//  +-----------------------------------------------------------------------------+
+//  |  BVH                                                                        |
+//  |  Flat bounding volume hierarchy over the triangles of a single mesh. The    |
+//  |  nodes live in one contiguous array and the leaves refer back to the        |
+//  |  mesh' CoreTri buffer through triIdx, so no triangle data is duplicated.    |
+//  +-----------------------------------------------------------------------------+
+class BVH
 {
 public:
-	void Intersect(Ray& ray, vector<BVHNode>& hitNode);
-	void ConstructBVH(Mesh& mesh);
-	void Partition_Binned_SAH();
-	void Partition_SAH(float rootPartitionScore);
+	// Upper limit for binCount.
+	static constexpr int MAXBINS = BVHBins::MAXBINS;
+	// Meshes with fewer triangles than this are always built on the calling thread.
+	static constexpr int PARALLEL_BUILD_THRESHOLD = 16384;
+	// Nodes with at least this many primitives are binned by all workers together.
+	static constexpr int PARALLEL_BINNING_THRESHOLD = 65536;
+	// Smallest subtree handed out as a separate build task.
+	static constexpr int SUBTREE_MIN_SIZE = 1024;
+	// Nodes this deep become leaves whatever their size, so that the fixed traversal stacks
+	// of STACKSIZE entries cannot overflow: a binary traversal holds at most one entry per
+	// level, plus the two children of the node being visited.
+	static constexpr int MAXDEPTH = 60;
+	static constexpr int STACKSIZE = 64;
+	// A 4-wide traversal replaces each node with at most four children, and the collapsed
+	// tree is no deeper than the binary one, so three pending entries per level suffice.
+	static constexpr int WIDE_STACKSIZE = 3 * MAXDEPTH + 1;
+	// SAH cost of a traversal step, relative to a ray/triangle test.
+	static constexpr float TRAVERSAL_COST = 1.0f;
+	static constexpr float INTERSECTION_COST = 1.0f;
+	// Exit distances of box tests are scaled up by this much, so rounding never makes a
+	// ray miss the box of a triangle that the watertight test would hit.
+	static constexpr float BOX_EXIT_SCALE = 1.0000004f;
+	// Refitting is abandoned for a rebuild once the SAH cost exceeds the cost at build time by this factor.
+	static constexpr float REFIT_DEGRADATION_LIMIT = 1.5f;
+
+	void Intersect(const Ray& ray, HitRecord& hit);
+	bool IsOccluded(const Ray& ray, float tMax);
+	static __m128 IntersectTriangleGroup(const ShearedRay& ray, const TriangleGroup& group, __m128& u, __m128& v);
+	void IntersectLeaf(const ShearedRay& ray, int first, int count, HitRecord& hit);
+	bool IsOccludedLeaf(const ShearedRay& ray, int first, int count, float tMax);
+	void IntersectBVH4(const Ray& ray, HitRecord& hit);
+	bool IsOccludedBVH4(const Ray& ray, float tMax);
+	void CollapseToBVH4();
+	void CollapseNode(int nodeIdx, int wideIdx);
+	float IntersectAABB(const Ray& ray, const float3& invD, const BVHNode& node, float tMax);
+	void IntersectPacket(RayPacket& packet);
+	float IntersectAABBPacket(const RayPacket& packet, const BVHNode& node, float tMax);
+	void IntersectTrianglePacket(RayPacket& packet, const TriangleGroup& group, int lane);
+	static float PacketMaxT(const RayPacket& packet);
+	void ConstructBVH(Mesh& mesh, tf::Executor* executor = 0);
+	void ConstructBVH(vector<AABB> bounds, tf::Executor* executor = 0);
+	void ConstructParallel(tf::Executor& executor);
+	void SubdivideTopLevel(vector<BVHNode>& top, int nodeIdx, int depth, vector<BVHSubtree>& subtrees, int subtreeSize, tf::Executor& executor);
+	void EmitNodes(const vector<BVHNode>& pool, int srcIdx, int dstIdx, const vector<BVHSubtree>& subtrees);
+	void Partition_Binned_SAH(vector<BVHNode>& pool, int& poolUsed, int nodeIdx, int depth);
+	bool FindBestSplit(const BVHNode& node, BVHSplit& split, tf::Executor* executor);
+	AABB CalculateCentroidBounds(int first, int last);
+	void BinPrimitives(int first, int last, const BVHSplit& split, BVHBins& bins);
+	int BinOf(uint primitive, const BVHSplit& split, int axis);
+	int PartitionPrimitives(int first, int count, const BVHSplit& split);
+	bool Refit();
+	void BuildTriangleGroups();
+	float CalculateSAHCost();
+	void UpdateNodeBounds(int nodeIdx);
 	float3 CalculateBoundingBoxCenter(AABB boundingBox);
-	AABB CalculateTriangleBounds(CoreTri& triangle);
-	AABB CalculateVoxelBounds(vector<CoreTri>& primitives);
-	float3 CalculateTriangleCentroid(float3 vertex0, float3 vertex1, float3 vertex2);
+	AABB CalculateTriangleBounds(const CoreTri& triangle);
 	float CalculateSurfaceArea(AABB bounds);
-	float CalculateBestArea(float3 splitPoint, vector<CoreTri>& bestObjectsRight, vector<CoreTri>& bestObjectsLeft);
 
 public:
-	BVHNode* m_Root;
-	BVHNode* m_Right;
-	BVHNode* m_Left;
-	bool m_IsLeaf;
-	AABB bounds;
-	vector<CoreTri> primitives;
+	// Node pool; nodes[0] is the root.
+	vector<BVHNode> nodes;
+	// The same tree collapsed to four children per node, used for single rays when
+	// wide is set. Packets keep using the binary nodes.
+	vector<BVH4Node> wideNodes;
+	bool wide = true;
+	// Indices into triangles, ordered such that every leaf references a contiguous range.
+	vector<uint> triIdx;
+	// Triangle data of the mesh this BVH was built for; owned by the Mesh. Null when
+	// the tree was built over other primitives, such as the instances of the TLAS.
+	const CoreTri* triangles = 0;
+	// Precomputed intersection data of the triangles, per leaf in groups of four.
+	// groupFirst holds the first group of the leaf that starts at each position in
+	// triIdx; other entries are unused.
+	vector<TriangleGroup> triangleGroups;
+	vector<int> groupFirst;
+	// Number of primitives in the tree.
+	int triangleCount = 0;
+	int nodesUsed = 0;
+	// SAH cost of the tree right after construction.
+	float buildCost = 0;
+	// Number of SAH bins evaluated per axis during construction.
+	int binCount = 16;
+
+private:
+	// Build-time data, released once construction finishes.
+	vector<AABB> primBounds;
+	vector<float3> centroids;
 };
 
 enum Axis
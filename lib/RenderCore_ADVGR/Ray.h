@@ -11,4 +11,44 @@ public:
 
 	float3 m_Origin;
 	float3 m_Direction;
+	// Ray cone for texture filtering: its width at the origin and its spread angle.
+	float m_ConeWidth = 0;
+	float m_ConeSpread = 0;
+};
+
+//  +-----------------------------------------------------------------------------+
+//  |  ShearedRay                                                                 |
+//  |  Per-ray constants of the watertight ray/triangle test of Woop, Benthin     |
+//  |  and Wald: kz is the axis the ray travels along most, and the shear maps    |
+//  |  the ray onto the z axis of the (kx, ky, kz) frame.                         |
+//  +-----------------------------------------------------------------------------+
+struct ShearedRay
+{
+	ShearedRay(const Ray& ray)
+	{
+		const float d[3] = { ray.m_Direction.x, ray.m_Direction.y, ray.m_Direction.z };
+		kz = fabsf(d[0]) > fabsf(d[1]) ? (fabsf(d[0]) > fabsf(d[2]) ? 0 : 2) : (fabsf(d[1]) > fabsf(d[2]) ? 1 : 2);
+		kx = (kz + 1) % 3, ky = (kx + 1) % 3;
+		Sx = d[kx] / d[kz], Sy = d[ky] / d[kz], Sz = 1.0f / d[kz];
+		origin[0] = ray.m_Origin.x, origin[1] = ray.m_Origin.y, origin[2] = ray.m_Origin.z;
+	}
+
+	float origin[3];
+	int kx, ky, kz;
+	float Sx, Sy, Sz;
+};
+
+//  +-----------------------------------------------------------------------------+
+//  |  HitRecord                                                                  |
+//  |  Closest intersection found along a ray so far. t doubles as the maximum    |
+//  |  distance for traversal; triIdx is -1 when nothing was hit. instIdx is      |
+//  |  the instance the triangle belongs to when tracing through the TLAS. u and  |
+//  |  v are the barycentric weights of vertex1 and vertex2 at the hit.           |
+//  +-----------------------------------------------------------------------------+
+struct HitRecord
+{
+	float t = numeric_limits<float>::max();
+	int triIdx = -1;
+	int instIdx = -1;
+	float u = 0, v = 0;
 };
@@ -0,0 +1,96 @@
+#pragma once
+#include <immintrin.h>
+#include "Ray.h"
+
+//  +-----------------------------------------------------------------------------+
+//  |  RayPacket                                                                  |
+//  |  A 4x4 block of coherent rays in SoA layout, traced together through the    |
+//  |  BVH two AVX registers at a time. Results are stored per lane in t, triIdx, |
+//  |  instIdx, u and v, with the same meaning as in HitRecord.                   |
+//  +-----------------------------------------------------------------------------+
+struct alignas(32) RayPacket
+{
+	static constexpr int SIZE = 16;
+	static constexpr int LANES = 8;
+
+	float ox[SIZE], oy[SIZE], oz[SIZE];
+	float dx[SIZE], dy[SIZE], dz[SIZE];
+	float rdx[SIZE], rdy[SIZE], rdz[SIZE];
+	float t[SIZE];
+	int triIdx[SIZE];
+	int instIdx[SIZE];
+	float u[SIZE], v[SIZE];
+
+	// Shear constants of the watertight triangle test, as in ShearedRay. The axes are
+	// shared by the packet: kz is the axis along which the slowest ray still moves
+	// fastest, so its shear stays finite for every ray.
+	float Sx[SIZE], Sy[SIZE], Sz[SIZE];
+	int kx, ky, kz;
+
+	// Interval bounds over all rays, used to cull boxes for the packet as a whole.
+	// Only valid when coherent is set: every direction component has the same,
+	// non-zero sign for the whole packet.
+	float3 minOrigin, maxOrigin;
+	float3 minRcpDirection, maxRcpDirection;
+	bool coherent = false;
+
+	void SetRay(int i, const Ray& ray)
+	{
+		ox[i] = ray.m_Origin.x, oy[i] = ray.m_Origin.y, oz[i] = ray.m_Origin.z;
+		dx[i] = ray.m_Direction.x, dy[i] = ray.m_Direction.y, dz[i] = ray.m_Direction.z;
+		t[i] = numeric_limits<float>::max();
+		triIdx[i] = instIdx[i] = -1;
+		u[i] = v[i] = 0;
+	}
+
+	Ray GetRay(int i) const { return Ray(make_float3(ox[i], oy[i], oz[i]), make_float3(dx[i], dy[i], dz[i])); }
+
+	HitRecord GetHit(int i) const
+	{
+		HitRecord hit;
+		hit.t = t[i], hit.triIdx = triIdx[i], hit.instIdx = instIdx[i];
+		hit.u = u[i], hit.v = v[i];
+		return hit;
+	}
+
+	// Computes the reciprocal directions, the shear and the packet interval bounds;
+	// call after all rays have been set.
+	void Prepare()
+	{
+		minOrigin = minRcpDirection = make_float3(numeric_limits<float>::max());
+		maxOrigin = maxRcpDirection = make_float3(-numeric_limits<float>::max());
+		int positive[3] = {}, negative[3] = {};
+		float slowest[3] = { numeric_limits<float>::max(), numeric_limits<float>::max(), numeric_limits<float>::max() };
+
+		for (int i = 0; i < SIZE; i++)
+		{
+			float3 o = make_float3(ox[i], oy[i], oz[i]);
+			float3 rd = make_float3(1.0f / dx[i], 1.0f / dy[i], 1.0f / dz[i]);
+			rdx[i] = rd.x, rdy[i] = rd.y, rdz[i] = rd.z;
+
+			minOrigin = fminf(minOrigin, o), maxOrigin = fmaxf(maxOrigin, o);
+			minRcpDirection = fminf(minRcpDirection, rd), maxRcpDirection = fmaxf(maxRcpDirection, rd);
+
+			positive[0] += dx[i] > 0, positive[1] += dy[i] > 0, positive[2] += dz[i] > 0;
+			negative[0] += dx[i] < 0, negative[1] += dy[i] < 0, negative[2] += dz[i] < 0;
+			slowest[0] = min(slowest[0], fabsf(dx[i])), slowest[1] = min(slowest[1], fabsf(dy[i])), slowest[2] = min(slowest[2], fabsf(dz[i]));
+		}
+
+		kz = slowest[0] > slowest[1] ? (slowest[0] > slowest[2] ? 0 : 2) : (slowest[1] > slowest[2] ? 1 : 2);
+		kx = (kz + 1) % 3, ky = (kx + 1) % 3;
+		const float* d[3] = { dx, dy, dz };
+		for (int i = 0; i < SIZE; i++)
+		{
+			Sx[i] = d[kx][i] / d[kz][i], Sy[i] = d[ky][i] / d[kz][i], Sz[i] = 1.0f / d[kz][i];
+		}
+
+		coherent = true;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			coherent &= positive[axis] == SIZE || negative[axis] == SIZE;
+		}
+
+		coherent &= isfinite(minRcpDirection.x) && isfinite(minRcpDirection.y) && isfinite(minRcpDirection.z);
+		coherent &= isfinite(maxRcpDirection.x) && isfinite(maxRcpDirection.y) && isfinite(maxRcpDirection.z);
+	}
+};
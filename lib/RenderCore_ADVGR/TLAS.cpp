@@ -0,0 +1,198 @@
+#include "TLAS.h"
+
+void TLAS::Build(const vector<BVHInstance>& sceneInstances, const vector<BVH*>& meshBVHs)
+{
+	blas = meshBVHs;
+	instances.clear();
+
+	// Instances of meshes that have not arrived yet or have no triangles are skipped.
+	vector<AABB> bounds;
+	for (const BVHInstance& instance : sceneInstances)
+	{
+		if (instance.meshIdx < 0 || instance.meshIdx >= (int)blas.size() || blas[instance.meshIdx] == 0 || blas[instance.meshIdx]->triangleCount == 0)
+		{
+			continue;
+		}
+
+		instances.push_back(instance);
+		bounds.push_back(CalculateInstanceBounds(instance, *blas[instance.meshIdx]));
+	}
+
+	// The instance tree is only ever traversed through its binary nodes.
+	bvh.wide = false;
+	bvh.ConstructBVH(move(bounds));
+}
+
+void TLAS::Intersect(const Ray& ray, HitRecord& hit)
+{
+	if (bvh.triangleCount == 0)
+	{
+		return;
+	}
+
+	float3 invD = 1.0f / ray.m_Direction;
+
+	// Scenes hold few instances, so a plain stack without ordering is good enough here;
+	// the closest hit found so far still culls everything behind it.
+	const BVHNode* stack[BVH::STACKSIZE];
+	int stackPtr = 0;
+	stack[stackPtr++] = &bvh.nodes[0];
+
+	while (stackPtr > 0)
+	{
+		const BVHNode* node = stack[--stackPtr];
+
+		if (bvh.IntersectAABB(ray, invD, *node, hit.t) == numeric_limits<float>::max())
+		{
+			continue;
+		}
+
+		if (node->IsLeaf())
+		{
+			for (int i = node->leftFirst; i < node->leftFirst + node->count; i++)
+			{
+				const BVHInstance& instance = instances[bvh.triIdx[i]];
+
+				// The direction is not renormalized, so t is the same in both spaces.
+				Ray objectRay(instance.invTransform.TransformPoint(ray.m_Origin), instance.invTransform.TransformVector(ray.m_Direction));
+
+				float t = hit.t;
+				blas[instance.meshIdx]->Intersect(objectRay, hit);
+
+				if (hit.t < t)
+				{
+					hit.instIdx = bvh.triIdx[i];
+				}
+			}
+		}
+		else
+		{
+			assert(stackPtr + 2 <= BVH::STACKSIZE);
+			stack[stackPtr++] = &bvh.nodes[node->leftFirst + 1];
+			stack[stackPtr++] = &bvh.nodes[node->leftFirst];
+		}
+	}
+}
+
+void TLAS::IntersectPacket(RayPacket& packet)
+{
+	if (bvh.triangleCount == 0)
+	{
+		return;
+	}
+
+	const BVHNode* stack[BVH::STACKSIZE];
+	int stackPtr = 0;
+	stack[stackPtr++] = &bvh.nodes[0];
+
+	while (stackPtr > 0)
+	{
+		const BVHNode* node = stack[--stackPtr];
+
+		if (bvh.IntersectAABBPacket(packet, *node, BVH::PacketMaxT(packet)) == numeric_limits<float>::max())
+		{
+			continue;
+		}
+
+		if (node->IsLeaf())
+		{
+			for (int i = node->leftFirst; i < node->leftFirst + node->count; i++)
+			{
+				const BVHInstance& instance = instances[bvh.triIdx[i]];
+
+				// An affine transform keeps the rays coherent, so the packet stays a packet.
+				RayPacket objectPacket;
+				for (int j = 0; j < RayPacket::SIZE; j++)
+				{
+					Ray ray = packet.GetRay(j);
+					objectPacket.SetRay(j, Ray(instance.invTransform.TransformPoint(ray.m_Origin), instance.invTransform.TransformVector(ray.m_Direction)));
+					objectPacket.t[j] = packet.t[j];
+				}
+				objectPacket.Prepare();
+
+				blas[instance.meshIdx]->IntersectPacket(objectPacket);
+
+				for (int j = 0; j < RayPacket::SIZE; j++)
+				{
+					if (objectPacket.t[j] < packet.t[j])
+					{
+						packet.t[j] = objectPacket.t[j];
+						packet.triIdx[j] = objectPacket.triIdx[j];
+						packet.u[j] = objectPacket.u[j], packet.v[j] = objectPacket.v[j];
+						packet.instIdx[j] = bvh.triIdx[i];
+					}
+				}
+			}
+		}
+		else
+		{
+			assert(stackPtr + 2 <= BVH::STACKSIZE);
+			stack[stackPtr++] = &bvh.nodes[node->leftFirst + 1];
+			stack[stackPtr++] = &bvh.nodes[node->leftFirst];
+		}
+	}
+}
+
+bool TLAS::IsOccluded(const Ray& ray, float tMax)
+{
+	if (bvh.triangleCount == 0)
+	{
+		return false;
+	}
+
+	float3 invD = 1.0f / ray.m_Direction;
+
+	const BVHNode* stack[BVH::STACKSIZE];
+	int stackPtr = 0;
+	stack[stackPtr++] = &bvh.nodes[0];
+
+	while (stackPtr > 0)
+	{
+		const BVHNode* node = stack[--stackPtr];
+
+		if (bvh.IntersectAABB(ray, invD, *node, tMax) == numeric_limits<float>::max())
+		{
+			continue;
+		}
+
+		if (node->IsLeaf())
+		{
+			for (int i = node->leftFirst; i < node->leftFirst + node->count; i++)
+			{
+				const BVHInstance& instance = instances[bvh.triIdx[i]];
+				Ray objectRay(instance.invTransform.TransformPoint(ray.m_Origin), instance.invTransform.TransformVector(ray.m_Direction));
+
+				if (blas[instance.meshIdx]->IsOccluded(objectRay, tMax))
+				{
+					return true;
+				}
+			}
+		}
+		else
+		{
+			assert(stackPtr + 2 <= BVH::STACKSIZE);
+			stack[stackPtr++] = &bvh.nodes[node->leftFirst + 1];
+			stack[stackPtr++] = &bvh.nodes[node->leftFirst];
+		}
+	}
+
+	return false;
+}
+
+AABB TLAS::CalculateInstanceBounds(const BVHInstance& instance, const BVH& blas)
+{
+	// Bound the eight transformed corners of the BLAS root.
+	const BVHNode& root = blas.nodes[0];
+	AABB bounds;
+
+	for (int i = 0; i < 8; i++)
+	{
+		float3 corner = make_float3(i & 1 ? root.maxBounds.x : root.minBounds.x, i & 2 ? root.maxBounds.y : root.minBounds.y, i & 4 ? root.maxBounds.z : root.minBounds.z);
+		float3 p = instance.transform.TransformPoint(corner);
+
+		bounds.minBounds = fminf(bounds.minBounds, p);
+		bounds.maxBounds = fmaxf(bounds.maxBounds, p);
+	}
+
+	return bounds;
+}
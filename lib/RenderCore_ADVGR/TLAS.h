@@ -0,0 +1,39 @@
+#pragma once
+#include "BVHNode.h"
+
+//  +-----------------------------------------------------------------------------+
+//  |  BVHInstance                                                                |
+//  |  Placement of a mesh in the scene. The BLAS of the mesh is shared by all    |
+//  |  instances that refer to it.                                                |
+//  +-----------------------------------------------------------------------------+
+struct BVHInstance
+{
+	int meshIdx = -1;
+	// Object to world, and world to object for transforming rays into the BLAS.
+	mat4 transform;
+	mat4 invTransform;
+};
+
+//  +-----------------------------------------------------------------------------+
+//  |  TLAS                                                                       |
+//  |  Top-level BVH over the world space bounds of all instances. Leaves refer   |
+//  |  to instances, whose bottom-level BVH is traversed with the ray in object   |
+//  |  space. Only the instance bounds are involved in a rebuild, so moving       |
+//  |  instances around does not touch the meshes.                                |
+//  +-----------------------------------------------------------------------------+
+class TLAS
+{
+public:
+	void Build(const vector<BVHInstance>& sceneInstances, const vector<BVH*>& meshBVHs);
+	void Intersect(const Ray& ray, HitRecord& hit);
+	void IntersectPacket(RayPacket& packet);
+	bool IsOccluded(const Ray& ray, float tMax);
+	AABB CalculateInstanceBounds(const BVHInstance& instance, const BVH& blas);
+
+public:
+	// Tree over the instances; its triIdx holds indices into instances.
+	BVH bvh;
+	vector<BVHInstance> instances;
+	// Bottom-level BVH per mesh index; owned by the core.
+	vector<BVH*> blas;
+};
@@ -0,0 +1,145 @@
+#include "Texture.h"
+
+Texture::Texture(const CoreTexDesc& desc, bool tiled) : tiled(tiled)
+{
+	width = desc.width, height = desc.height;
+
+	// Levels follow each other in the source data, halving in size as in ConstructMIPmaps.
+	levelCount = 0;
+	int offset = 0, w = width, h = height;
+	while (levelCount < min((int)desc.MIPlevels, MAXLEVELS) && w > 0 && h > 0)
+	{
+		levelWidth[levelCount] = w;
+		levelHeight[levelCount] = h;
+		levelCount++;
+		w >>= 1, h >>= 1;
+	}
+
+	levelCount = max(levelCount, 1);
+
+	// Tiled levels are padded to whole tiles.
+	for (int level = 0; level < levelCount; level++)
+	{
+		const int tilesX = (levelWidth[level] + TEXELTILE - 1) / TEXELTILE;
+		const int tilesY = (levelHeight[level] + TEXELTILE - 1) / TEXELTILE;
+		levelOffset[level] = offset;
+		levelPitch[level] = tiled ? tilesX : levelWidth[level];
+		offset += tiled ? tilesX * tilesY * TEXELTILE * TEXELTILE : levelWidth[level] * levelHeight[level];
+	}
+
+	if (desc.storage == TexelStorage::ARGB128)
+	{
+		fdata.resize(offset);
+		CopyLevels(desc.fdata, fdata);
+	}
+	else
+	{
+		idata.resize(offset);
+		CopyLevels(desc.idata, idata);
+	}
+}
+
+// Copies the row-major levels of the source into the layout of this texture.
+template <class T> void Texture::CopyLevels(const T* src, vector<T>& dst)
+{
+	for (int level = 0; level < levelCount; level++)
+	{
+		for (int y = 0; y < levelHeight[level]; y++)
+		{
+			for (int x = 0; x < levelWidth[level]; x++)
+			{
+				dst[TexelIndex(level, x, y)] = src[x + y * levelWidth[level]];
+			}
+		}
+
+		src += levelWidth[level] * levelHeight[level];
+	}
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  Texture::Sample                                                            |
+//  |  Trilinear lookup: bilinear samples of the two levels around lambda,        |
+//  |  blended by its fraction. Magnified textures use level 0 only.              |
+//  +-----------------------------------------------------------------------------+
+float3 Texture::Sample(const float2& uv, float lambda) const
+{
+	// textures repeat outside [0, 1)
+	const float2 wrapped = make_float2(uv.x - floorf(uv.x), uv.y - floorf(uv.y));
+
+	if (!(lambda > 0) || levelCount == 1)
+	{
+		return SampleBilinear(0, wrapped);
+	}
+
+	if (lambda >= levelCount - 1)
+	{
+		return SampleBilinear(levelCount - 1, wrapped);
+	}
+
+	const int level = (int)lambda;
+	const float f = lambda - level;
+	return (1 - f) * SampleBilinear(level, wrapped) + f * SampleBilinear(level + 1, wrapped);
+}
+
+// Bilinear lookup in a single level, for uv in [0, 1); neighbours wrap around the edges.
+float3 Texture::SampleBilinear(int level, const float2& uv) const
+{
+	const int w = levelWidth[level], h = levelHeight[level];
+	const float x = uv.x * w - 0.5f, y = uv.y * h - 0.5f;
+	const float fx = floorf(x), fy = floorf(y);
+	const float wx = x - fx, wy = y - fy;
+
+	int x0 = (int)fx, y0 = (int)fy;
+	int x1 = x0 + 1, y1 = y0 + 1;
+	if (x0 < 0) x0 = w - 1;
+	if (y0 < 0) y0 = h - 1;
+	if (x1 >= w) x1 = 0;
+	if (y1 >= h) y1 = 0;
+
+	// the texel offset is a sum of a column and a row part, in either layout
+	const int c0 = ColumnOffset(level, x0), c1 = ColumnOffset(level, x1);
+	const int r0 = levelOffset[level] + RowOffset(level, y0), r1 = levelOffset[level] + RowOffset(level, y1);
+
+	const float3 top = (1 - wx) * FetchTexel(r0 + c0) + wx * FetchTexel(r0 + c1);
+	const float3 bottom = (1 - wx) * FetchTexel(r1 + c0) + wx * FetchTexel(r1 + c1);
+	return (1 - wy) * top + wy * bottom;
+}
+
+float3 Texture::FetchTexel(int idx) const
+{
+	if (!fdata.empty())
+	{
+		return make_float3(fdata[idx]);
+	}
+
+	const uchar4 texel = idata[idx];
+	const float scale = 1.0f / 255;
+	return make_float3(texel.x * scale, texel.y * scale, texel.z * scale);
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  Texture::CalculateLOD                                                      |
+//  |  Half the log2 of the ratio between the texel area and the world space      |
+//  |  area of a triangle. This is what HostMesh stores in CoreTri::LOD, but      |
+//  |  computed from the transformed vertices, so instance scaling is taken into  |
+//  |  account, and also for meshes from loaders that leave LOD at zero.          |
+//  +-----------------------------------------------------------------------------+
+float Texture::CalculateLOD(const CoreTri& tri) const
+{
+	const float Ta = (float)(width * height) * fabsf((tri.u1 - tri.u0) * (tri.v2 - tri.v0) - (tri.u2 - tri.u0) * (tri.v1 - tri.v0));
+	const float Pa = length(cross(tri.vertex1 - tri.vertex0, tri.vertex2 - tri.vertex0));
+
+	if (Ta <= 0 || Pa <= 0)
+	{
+		return 0;
+	}
+
+	return 0.5f * log2f(Ta / Pa);
+}
+
+// MIP level for a ray cone of the specified width hitting a surface with normal N along D.
+float Texture::CalculateLambda(float triLOD, float coneWidth, const float3& D, const float3& N)
+{
+	const float cosTheta = max(1e-4f, fabsf(dot(D, N)));
+	return triLOD + log2f(max(1e-20f, coneWidth) / cosTheta);
+}
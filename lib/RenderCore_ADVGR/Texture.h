@@ -0,0 +1,55 @@
+#pragma once
+#include "platform.h"
+
+using namespace lighthouse2;
+
+#include "core_api_base.h"
+
+//  +-----------------------------------------------------------------------------+
+//  |  Texture                                                                    |
+//  |  Host-side copy of a texture and the MIP chain built by                     |
+//  |  HostTexture::ConstructMIPmaps, sampled with trilinear filtering. The MIP   |
+//  |  level comes from the width of a ray cone at the hit, as in Akenine-Moller  |
+//  |  et al., "Texture Level of Detail Strategies for Real-Time Ray Tracing".    |
+//  |  A minified texture is then read from a level with about one texel per      |
+//  |  pixel, which keeps the texels that are touched in cache.                   |
+//  |  When tiled, every level is stored in blocks of TEXELTILE x TEXELTILE       |
+//  |  texels, so the four texels of a bilinear lookup and the neighbouring       |
+//  |  texels of nearby hits mostly share a cache line, in either direction.      |
+//  +-----------------------------------------------------------------------------+
+class Texture
+{
+public:
+	static constexpr int MAXLEVELS = 16;
+	// Width and height of a tile; a tile of 32-bit texels is one 64-byte cache line.
+	static constexpr int TEXELTILE = 4;
+
+	Texture(const CoreTexDesc& desc, bool tiled = true);
+	float3 Sample(const float2& uv, float lambda) const;
+	float3 SampleBilinear(int level, const float2& uv) const;
+	float3 FetchTexel(int idx) const;
+	int TexelIndex(int level, int x, int y) const { return levelOffset[level] + ColumnOffset(level, x) + RowOffset(level, y); }
+	// Parts of the texel offset within a level; within a tile texels are stored row by row.
+	int ColumnOffset(int level, uint x) const { return tiled ? (x / TEXELTILE) * TEXELTILE * TEXELTILE + x % TEXELTILE : x; }
+	int RowOffset(int level, uint y) const { return tiled ? ((y / TEXELTILE) * levelPitch[level] * TEXELTILE + y % TEXELTILE) * TEXELTILE : y * levelPitch[level]; }
+	float CalculateLOD(const CoreTri& tri) const;
+	static float CalculateLambda(float triLOD, float coneWidth, const float3& D, const float3& N);
+
+public:
+	int width = 0, height = 0;
+	// Number of usable MIP levels; levels smaller than a texel are dropped.
+	int levelCount = 1;
+	bool tiled = true;
+
+private:
+	template <class T> void CopyLevels(const T* src, vector<T>& dst);
+
+	// Texel data in the layout chosen at construction; only one of the two is used.
+	vector<uchar4> idata;
+	vector<float4> fdata;
+	// Start of every level in the texel data, its size, and its row pitch: texels per
+	// row when not tiled, tiles per row otherwise.
+	int levelOffset[MAXLEVELS];
+	int levelWidth[MAXLEVELS], levelHeight[MAXLEVELS];
+	int levelPitch[MAXLEVELS];
+};
@@ -20,6 +20,10 @@
 
 #pragma once
 
+// core-specific settings
+#define TILESIZE	32		// width and height of the screen tiles handed out to render threads
+#define PACKETSIZE	4		// primary rays are traced in packets of PACKETSIZE x PACKETSIZE pixels
+
 #include "platform.h"
 
 using namespace lighthouse2;
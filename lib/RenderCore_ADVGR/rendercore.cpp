@@ -45,22 +45,100 @@ void RenderCore::SetTarget( GLTexture* target, const uint )
 //  +-----------------------------------------------------------------------------+
 void RenderCore::SetGeometry( const int meshIdx, const float4* vertexData, const int vertexCount, const int triangleCount, const CoreTri* triangleData )
 {
-	Mesh newMesh;
-	// copy the supplied vertices; we cannot assume that the render system does not modify
-	// the original data after we leave this function.
-	newMesh.vertices = new float4[vertexCount];
-	newMesh.vcount = vertexCount;
-	memcpy(newMesh.vertices, vertexData, vertexCount * sizeof(float4));
-	// copy the supplied 'fat triangles'
-	newMesh.triangles = new CoreTri[vertexCount / 3];
-	memcpy(newMesh.triangles, triangleData, (vertexCount / 3) * sizeof(CoreTri));
-	meshes.push_back(newMesh);
+	if (meshIdx >= (int)meshes.size())
+	{
+		meshes.resize(meshIdx + 1);
+		blas.resize(meshIdx + 1, 0);
+	}
 
+	Mesh& newMesh = meshes[meshIdx];
 	buildBvhTimer.reset();
-	root = new BVHNode();
-	root->ConstructBVH(newMesh);
+
+	// Animated meshes are resent with new vertex positions but the same triangles. In
+	// that case the data is updated in place and the existing BVH refitted, unless the
+	// motion degraded it too much.
+	if (blas[meshIdx] != 0 && newMesh.vcount == vertexCount)
+	{
+		memcpy(newMesh.vertices, vertexData, vertexCount * sizeof(float4));
+		memcpy(newMesh.triangles, triangleData, (vertexCount / 3) * sizeof(CoreTri));
+
+		if (blas[meshIdx]->Refit())
+		{
+			coreStats.bvhBuildTime = buildBvhTimer.elapsed();
+			instancesDirty = true;
+			return;
+		}
+	}
+	else
+	{
+		// replace the previous data for this mesh index, if any
+		delete[] newMesh.vertices;
+		delete[] newMesh.triangles;
+		// copy the supplied vertices; we cannot assume that the render system does not modify
+		// the original data after we leave this function.
+		newMesh.vertices = new float4[vertexCount];
+		newMesh.vcount = vertexCount;
+		memcpy(newMesh.vertices, vertexData, vertexCount * sizeof(float4));
+		// copy the supplied 'fat triangles'
+		newMesh.triangles = new CoreTri[vertexCount / 3];
+		memcpy(newMesh.triangles, triangleData, (vertexCount / 3) * sizeof(CoreTri));
+	}
+
+	delete blas[meshIdx];
+	blas[meshIdx] = new BVH();
+	blas[meshIdx]->binCount = bvhBins;
+	blas[meshIdx]->wide = bvhWidth == 4;
+	blas[meshIdx]->ConstructBVH(newMesh, &executor);
 	coreStats.bvhBuildTime = buildBvhTimer.elapsed();
-	coreStats.triangleCount = newMesh.vcount / 3;
+
+	coreStats.triangleCount = 0;
+	for (Mesh& mesh : meshes)
+	{
+		coreStats.triangleCount += mesh.vcount / 3;
+	}
+
+	// the tlas refers to the old blas
+	instancesDirty = true;
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  RenderCore::SetInstance                                                    |
+//  |  Set instance details.                                                LH2'19|
+//  +-----------------------------------------------------------------------------+
+void RenderCore::SetInstance( const int instanceIdx, const int meshIdx, const mat4& matrix )
+{
+	// A '-1' mesh denotes the end of the instance stream;
+	// adjust the instances vector if we have more.
+	if (meshIdx == -1)
+	{
+		if (instances.size() > instanceIdx) instances.resize( instanceIdx );
+		instancesDirty = true;
+		return;
+	}
+	// For the first frame, instances are added to the instances vector.
+	// For subsequent frames existing slots are overwritten / updated.
+	if (instanceIdx >= instances.size()) instances.resize( instanceIdx + 1 );
+	instances[instanceIdx].meshIdx = meshIdx;
+	instances[instanceIdx].transform = matrix;
+	instances[instanceIdx].invTransform = matrix.Inverted();
+	instancesDirty = true;
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  RenderCore::FinalizeInstances                                              |
+//  |  Rebuild the top-level BVH. This only involves the instance bounds, so it   |
+//  |  is cheap enough to do whenever a transform changes.                        |
+//  +-----------------------------------------------------------------------------+
+void RenderCore::FinalizeInstances()
+{
+	if (!instancesDirty)
+	{
+		return;
+	}
+
+	tlas.bvh.binCount = bvhBins;
+	tlas.Build(instances, blas);
+	instancesDirty = false;
 }
 
 //  +-----------------------------------------------------------------------------+
@@ -71,90 +149,168 @@ void RenderCore::Render( const ViewPyramid& view, const Convergence converge, bo
 {
 	renderTimer.reset();
 
+	int tilesX = (SCRWIDTH + TILESIZE - 1) / TILESIZE;
+	int tilesY = (SCRHEIGHT + TILESIZE - 1) / TILESIZE;
+	int tileCount = tilesX * tilesY;
+
+	// Every worker keeps pulling the next tile until none are left, so threads that
+	// end up with cheap tiles pick up the slack of tiles full of glass and mirrors.
+	atomic<int> nextTile{ 0 };
+	tf::Taskflow taskflow;
+	for (size_t i = 0; i < executor.num_workers(); i++)
+	{
+		taskflow.emplace([&]()
+		{
+			for (int tileIdx = nextTile++; tileIdx < tileCount; tileIdx = nextTile++)
+			{
+				RenderTile(view, tileIdx, tilesX);
+			}
+		});
+	}
+	executor.run(taskflow).wait();
+	frameIndex++;
+
+	// Copy pixel buffer to OpenGL render target texture
+	glBindTexture( GL_TEXTURE_2D, targetTextureID );
+	glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, SCRWIDTH, SCRHEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, screenPixels);
+
+	coreStats.renderTime = renderTimer.elapsed();
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  RenderCore::RenderTile                                                     |
+//  |  Trace and convert the pixels of a single screen tile. Only touches its     |
+//  |  own pixels and keeps its ray and random state local, so tiles can be       |
+//  |  rendered concurrently.                                                     |
+//  +-----------------------------------------------------------------------------+
+static_assert(PACKETSIZE * PACKETSIZE == RayPacket::SIZE, "a packet covers PACKETSIZE x PACKETSIZE pixels");
+
+void RenderCore::RenderTile( const ViewPyramid& view, int tileIdx, int tilesX )
+{
 	float dx = 1.0f / (SCRWIDTH - 1);
 	float dy = 1.0f / (SCRHEIGHT - 1);
 
-	// For anti aliasing
+	int x0 = (tileIdx % tilesX) * TILESIZE;
+	int y0 = (tileIdx / tilesX) * TILESIZE;
+	int x1 = min(x0 + TILESIZE, SCRWIDTH);
+	int y1 = min(y0 + TILESIZE, SCRHEIGHT);
+
+	// For anti aliasing; seeded per frame and tile so the result does not depend on
+	// which thread picked up the tile.
 	float samplingRate = 1;
-	random_device rd;
-	mt19937 gen(rd());
+	mt19937 gen(frameIndex * 65537u + tileIdx);
 	uniform_real_distribution<> dist(0, 1);
 
-	for (int y = 0; y < SCRHEIGHT; y++)
+	for (int y = y0; y < y1; y += PACKETSIZE)
 	{
-		for (int x = 0; x < SCRWIDTH; x++)
+		for (int x = x0; x < x1; x += PACKETSIZE)
 		{
 			for (int s = 0; s < samplingRate; s++)
 			{
-				// screen width
-				float3 sx = (x + dist(gen)) * dx * (view.p2 - view.p1);
-				// screen height
-				float3 sy = (y + dist(gen)) * dy * (view.p3 - view.p1);
-				// point on the screen
-				float3 point = view.p1 + sx + sy;
-				// direction
-				float3 direction = normalize(point - view.pos);
-
-				ray.m_Origin = view.pos;
-				ray.m_Direction = direction;
-
-				screenData[x + y * SCRWIDTH] += Trace(ray, 0);
+				// Primary rays of a block of pixels start at the camera and point in nearly
+				// the same direction, so they are traced as a packet.
+				RayPacket packet;
+
+				for (int i = 0; i < RayPacket::SIZE; i++)
+				{
+					int px = x + i % PACKETSIZE;
+					int py = y + i / PACKETSIZE;
+
+					// screen width
+					float3 sx = (px + dist(gen)) * dx * (view.p2 - view.p1);
+					// screen height
+					float3 sy = (py + dist(gen)) * dy * (view.p3 - view.p1);
+					// point on the screen
+					float3 point = view.p1 + sx + sy;
+					// direction
+					float3 direction = normalize(point - view.pos);
+
+					packet.SetRay(i, Ray(view.pos, direction));
+				}
+
+				if (usePackets)
+				{
+					packet.Prepare();
+					tlas.IntersectPacket(packet);
+				}
+
+				for (int i = 0; i < RayPacket::SIZE; i++)
+				{
+					int px = x + i % PACKETSIZE;
+					int py = y + i / PACKETSIZE;
+
+					if (px >= x1 || py >= y1)
+					{
+						continue;
+					}
+
+					Ray ray = packet.GetRay(i);
+					ray.m_ConeSpread = view.spreadAngle;
+					screenData[px + py * SCRWIDTH] += usePackets ? Shade(ray, ResolveHit(ray, packet.GetHit(i)), 0) : Trace(ray, 0);
+				}
 			}
 
-			screenData[x + y * SCRWIDTH] /= samplingRate + 1;
-		}
-	}
+			for (int py = y; py < min(y + PACKETSIZE, y1); py++)
+			{
+				for (int px = x; px < min(x + PACKETSIZE, x1); px++)
+				{
+					screenData[px + py * SCRWIDTH] /= samplingRate + 1;
 
-	for (int i = 0; i < SCRWIDTH * SCRHEIGHT; i++)
-	{
-		float3 p = screenData[i];
+					float3 p = screenData[px + py * SCRWIDTH];
 
-		int red = clamp((int)(p.x * 256), 0, 255);
-		int green = clamp((int)(p.y * 256), 0, 255);
-		int blue = clamp((int)(p.z * 256), 0, 255);
+					int red = clamp((int)(p.x * 256), 0, 255);
+					int green = clamp((int)(p.y * 256), 0, 255);
+					int blue = clamp((int)(p.z * 256), 0, 255);
 
-		screenPixels[i] = (blue << 16) + (green << 8) + red;
+					screenPixels[px + py * SCRWIDTH] = (blue << 16) + (green << 8) + red;
+				}
+			}
+		}
 	}
+}
 
-	// Copy pixel buffer to OpenGL render target texture
-	glBindTexture( GL_TEXTURE_2D, targetTextureID );
-	glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, SCRWIDTH, SCRHEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, screenPixels);
+tuple<CoreTri, float, float3, CoreMaterial, float2> RenderCore::Intersect(Ray ray)
+{
+	HitRecord hit;
+	tlas.Intersect(ray, hit);
 
-	coreStats.renderTime = renderTimer.elapsed();
+	return ResolveHit(ray, hit);
 }
 
-tuple<CoreTri, float, float3, CoreMaterial> RenderCore::Intersect(Ray ray)
+//  +-----------------------------------------------------------------------------+
+//  |  RenderCore::ResolveHit                                                     |
+//  |  Fetches the shading data for a hit found in the TLAS, and checks whether   |
+//  |  a sphere is closer. The barycentrics of the hit give the interpolated      |
+//  |  normal and texture coordinates.                                            |
+//  +-----------------------------------------------------------------------------+
+tuple<CoreTri, float, float3, CoreMaterial, float2> RenderCore::ResolveHit(const Ray& ray, const HitRecord& hit)
 {
 	float t_min = numeric_limits<float>::max();
 	CoreTri tri;
 	CoreMaterial coreMaterial;
 	float3 normal = make_float3(0);
+	float2 uv = make_float2(0);
 
-	vector<BVHNode> nodes = {};
-	root->Intersect(ray, nodes);
-
-	if (nodes.size() == 0)
+	if (hit.triIdx != -1)
 	{
-		return make_tuple(tri, t_min, normal, coreMaterial);
-	}
-
-	for (int i = 0; i < nodes.size(); i++)
-	{
-		vector<CoreTri> primitives = nodes[i].primitives;
-
-		for (int j = 0; j < primitives.size(); j++)
+		const BVHInstance& instance = tlas.instances[hit.instIdx];
+		t_min = hit.t;
+		tri = meshes[instance.meshIdx].triangles[hit.triIdx];
+		coreMaterial = materials[tri.material];
+
+		const float w = 1 - hit.u - hit.v;
+		uv = make_float2(w * tri.u0 + hit.u * tri.u1 + hit.v * tri.u2, w * tri.v0 + hit.u * tri.v1 + hit.v * tri.v2);
+		float3 N = w * tri.vN0 + hit.u * tri.vN1 + hit.v * tri.vN2;
+		if (dot(N, N) == 0)
 		{
-			// Check if we are able to intersect a triangle. If not, max float is returned
-			float t = Utils::IntersectTriangle(ray, primitives[j].vertex0, primitives[j].vertex1, primitives[j].vertex2);
-
-			if (t < t_min)
-			{
-				t_min = t;
-				tri = primitives[j];
-				coreMaterial = materials[tri.material];
-				normal = make_float3(primitives[j].Nx, primitives[j].Ny, primitives[j].Nz);
-			}
+			N = make_float3(tri.Nx, tri.Ny, tri.Nz);
 		}
+
+		// Shading happens in world space.
+		tri.vertex0 = instance.transform.TransformPoint(tri.vertex0);
+		tri.vertex1 = instance.transform.TransformPoint(tri.vertex1);
+		tri.vertex2 = instance.transform.TransformPoint(tri.vertex2);
+		normal = normalize(instance.invTransform.Transposed().TransformVector(N));
 	}
 
 	for (auto& sphere : m_spheres)
@@ -169,13 +325,36 @@ tuple<CoreTri, float, float3, CoreMaterial> RenderCore::Intersect(Ray ray)
 			normal = normalize((ray.m_Origin + ray.m_Direction * t_min) - sphere.m_CenterPosition);
 		}
 	}
-	return make_tuple(tri, t_min, normal, coreMaterial);
+	return make_tuple(tri, t_min, normal, coreMaterial, uv);
+}
+
+bool RenderCore::IsOccluded(float3 origin, float3 direction, float tMax)
+{
+	Ray shadowRay(origin, direction);
+
+	if (tlas.IsOccluded(shadowRay, tMax))
+	{
+		return true;
+	}
+
+	for (auto& sphere : m_spheres)
+	{
+		if (Utils::IntersectSphere(shadowRay, sphere) < tMax)
+		{
+			return true;
+		}
+	}
+
+	return false;
 }
 
 float3 RenderCore::Trace(Ray ray, int depth)
 {
-	tuple intersect = Intersect(ray);
+	return Shade(ray, Intersect(ray), depth);
+}
 
+float3 RenderCore::Shade(Ray ray, const tuple<CoreTri, float, float3, CoreMaterial, float2>& intersect, int depth)
+{
 	float t_min = get<1>(intersect);
 
 	// If a ray missed a primitive, show a skydome
@@ -195,38 +374,15 @@ float3 RenderCore::Trace(Ray ray, int depth)
 	float3 normalVector = get<2>(intersect);
 	float3 color = make_float3(material.color.value.x, material.color.value.y, material.color.value.z);
 	float3 intersectionPoint = ray.m_Origin + ray.m_Direction * t_min;
+	// Width of the ray cone at the hit; secondary rays start out this wide.
+	float coneWidth = ray.m_ConeWidth + ray.m_ConeSpread * t_min;
 
 	// If the material contains a texture, set texture
 	if (material.color.textureID > -1)
 	{
-		CoreTri triangle = get<0>(intersect);
-
-		auto& texture = textures[material.color.textureID];
-
-		float3 p0 = intersectionPoint - triangle.vertex0;
-		float3 p1 = intersectionPoint - triangle.vertex1;
-		float3 p2 = intersectionPoint - triangle.vertex2;
-
-		// Main triangle area a
-		float a = length(cross(p0 - p1, p0 - p2));
-		// p1's triangle area / a
-		float u = length(cross(p1, p2)) / a;
-		// p2's triangle area / a 
-		float v = length(cross(p2, p0)) / a;
-		// p2's triangle area / a 
-		float w = length(cross(p0, p1)) / a; 
-
-		float uu = triangle.u0 * u + triangle.u1 * v + triangle.u2 * w;
-		float vv = triangle.v0 * u + triangle.v1 * v + triangle.v2 * w;
-
-		int xPixel = float(texture.width) * uu;
-		int yPixel = float(texture.height) * vv;
-		int pixelIdx = yPixel + xPixel * texture.width;
-
-		auto uvColors = texture.idata[pixelIdx];
-
-		float devision = 1.0f / 255;
-		color = make_float3(uvColors.x * devision, uvColors.y * devision, uvColors.z * devision);
+		const Texture& texture = textures[material.color.textureID];
+		float lambda = Texture::CalculateLambda(texture.CalculateLOD(get<0>(intersect)), coneWidth, ray.m_Direction, normalVector);
+		color = texture.Sample(get<4>(intersect), lambda);
 	}
 	
 	// Recursion cap
@@ -244,6 +400,8 @@ float3 RenderCore::Trace(Ray ray, int depth)
 		Ray reflected;
 		reflected.m_Origin = intersectionPoint;
 		reflected.m_Direction = Reflect(ray.m_Direction, normalVector);
+		reflected.m_ConeWidth = coneWidth;
+		reflected.m_ConeSpread = ray.m_ConeSpread;
 
 		float3 m_reflectedColor = color;
 		m_reflectedColor = Trace(reflected, depth + 1);
@@ -262,6 +420,7 @@ float3 RenderCore::Trace(Ray ray, int depth)
 		float3 bias = EPSILON * normalVector;
 		bool outside = dot(ray.m_Direction, normalVector) < 0;
 		float3 newOrigin = outside ? intersectionPoint - bias : intersectionPoint + bias;
+		ray.m_ConeWidth = coneWidth;
 
 		// Calculate chance for reflection and refraction
 		float kr = Fresnel(intersectionPoint, normalVector, ior);
@@ -291,20 +450,17 @@ float3 RenderCore::CalculateLightContribution(float3& origin, float3& normal, fl
 
 	for (CorePointLight& light : m_pointLights)
 	{
-		ray.m_Origin = origin;
-		ray.m_Direction = normalize(light.position - origin);
-
-		tuple intersect = Intersect(ray);
-
-		float t_min = get<1>(intersect);
+		float3 toLight = light.position - origin;
+		float distance = length(toLight);
+		float3 L = toLight / distance;
 
-		if (t_min != numeric_limits<float>::max())
+		// Only blockers between the surface and the light matter.
+		if (IsOccluded(origin, L, distance - EPSILON))
 		{
 			return m_color * 0.1;
 		}
 
 		float3 N = normalize(normal);
-		float3 L = normalize(light.position - origin);
 
 		float lambertian = dot(N, L);
 
@@ -523,18 +679,35 @@ void lh2core::RenderCore::SetTextures(const CoreTexDesc* tex, const int textureC
 
 	for (int i = 0; i < textureCount; i++)
 	{
-		CoreTexDesc texture;
-		texture.fdata = tex[i].fdata;
-		texture.firstPixel = tex[i].firstPixel;
-		texture.flags = tex[i].flags;
-		texture.height = tex[i].height;
-		texture.idata = tex[i].idata;
-		texture.MIPlevels = tex[i].MIPlevels;
-		texture.pixelCount = tex[i].pixelCount;
-		texture.storage = tex[i].storage;
-		texture.width = tex[i].width;
-
-		textures.push_back(texture);
+		textures.push_back(Texture(tex[i], tiledTextures));
+	}
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  RenderCore::Setting                                                        |
+//  |  Modify a render setting.                                                   |
+//  +-----------------------------------------------------------------------------+
+void RenderCore::Setting( const char* name, const float value )
+{
+	if (!strcmp( name, "bvhBins" ))
+	{
+		// applies to BVHs built after this call
+		bvhBins = clamp( (int)value, 2, BVH::MAXBINS );
+	}
+	else if (!strcmp( name, "bvhWidth" ))
+	{
+		// applies to BVHs built after this call
+		bvhWidth = value >= 4 ? 4 : 2;
+	}
+	else if (!strcmp( name, "tiledTextures" ))
+	{
+		// store texels in tiles (1) or row by row (0); applies to textures set after this call
+		tiledTextures = value != 0;
+	}
+	else if (!strcmp( name, "packets" ))
+	{
+		// trace primary rays in packets (1) or one by one (0)
+		usePackets = value != 0;
 	}
 }
 
@@ -17,7 +17,9 @@
 #include "Ray.h"
 #include "Sphere.h"
 #include "BVHNode.h"
+#include "TLAS.h"
 #include "Mesh.h"
+#include "Texture.h"
 
 namespace lh2core
 {
@@ -47,8 +49,12 @@ public:
 
 	// Our methods:
 	void Render(const ViewPyramid& view, const Convergence converge, bool async);
+	void RenderTile(const ViewPyramid& view, int tileIdx, int tilesX);
 	float3 Trace(Ray ray, int depth = 0);
-	tuple<CoreTri, float, float3, CoreMaterial> Intersect(Ray ray);
+	float3 Shade(Ray ray, const tuple<CoreTri, float, float3, CoreMaterial, float2>& intersect, int depth);
+	tuple<CoreTri, float, float3, CoreMaterial, float2> Intersect(Ray ray);
+	tuple<CoreTri, float, float3, CoreMaterial, float2> ResolveHit(const Ray& ray, const HitRecord& hit);
+	bool IsOccluded(float3 origin, float3 direction, float tMax);
 	float3 CalculateLightContribution(float3& origin, float3& normal, float3 &m_color, CoreMaterial &material);
 	float3 Reflect(float3& in, float3 normal);
 	float3 Refract(float3& in, float3& normal, float ior);
@@ -56,10 +62,10 @@ public:
 
 	// unimplemented for the minimal core
 	inline void SetProbePos( const int2 pos ) override {}
-	inline void Setting(const char* name, float value ) override {}
+	void Setting(const char* name, float value ) override;
 
-	inline void SetInstance( const int instanceIdx, const int modelIdx, const mat4& transform ) override {}
-	inline void FinalizeInstances() override {}
+	void SetInstance( const int instanceIdx, const int modelIdx, const mat4& transform ) override;
+	void FinalizeInstances() override;
 
 	// internal methods
 private:
@@ -70,6 +76,8 @@ private:
 	vector<Mesh> meshes;							// mesh data storage
 	Timer renderTimer;								// timers for asynchronous rendering
 	Timer buildBvhTimer;							// timers for building bvh tree
+	tf::Executor executor;							// worker threads for tile rendering
+	uint frameIndex = 0;							// seeds the per-tile random streams
 public:
 	CoreStats coreStats;							// rendering statistics
 	unsigned int screenPixels[SCRWIDTH * SCRHEIGHT];
@@ -81,7 +89,7 @@ public:
 	// material data storage
 	vector<CoreMaterial> materials;           
 	// texture data storage
-	vector<CoreTexDesc> textures;        
+	vector<Texture> textures;
 
 	 // Point lights.
 	vector<CorePointLight> m_pointLights;
@@ -94,8 +102,14 @@ public:
 
 	vector<Sphere> m_spheres;
 
-	Ray ray;
-	BVHNode* root;
+	vector<BVH*> blas;								// bottom-level BVH per mesh index
+	vector<BVHInstance> instances;					// instance data received via SetInstance
+	TLAS tlas;										// top-level BVH over the instances
+	bool instancesDirty = true;						// tlas needs to be rebuilt before rendering
+	int bvhBins = 16;								// SAH bins per axis for new BVH builds
+	int bvhWidth = 4;								// trace single rays through a 2- or 4-wide BVH
+	bool tiledTextures = true;						// store texels in tiles rather than row by row
+	bool usePackets = true;							// trace primary rays as packets
 
 	int maxDepth = 3;
 };
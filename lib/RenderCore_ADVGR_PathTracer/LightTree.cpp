@@ -0,0 +1,338 @@
+#include "LightTree.h"
+
+//  +-----------------------------------------------------------------------------+
+//  |  LightTree::Build                                                           |
+//  |  Agglomerative construction, as UpdateLightTree in rendercore_optix7:       |
+//  |  clusters are merged in pairs that are each other's best match, where the   |
+//  |  cost of a pair is the intensity times the squared diagonal of the merged   |
+//  |  bounds. A chain step is only taken when it lowers the cost, which stops    |
+//  |  the search from cycling between equally good matches.                      |
+//  +-----------------------------------------------------------------------------+
+void LightTree::Build(const vector<CoreLightTri>& triLights, const vector<CorePointLight>& pointLights, const vector<CoreSpotLight>& spotLights)
+{
+	CreateLeaves(triLights, pointLights, spotLights);
+
+	if (leafCount == 0)
+	{
+		return;
+	}
+
+	nodes.reserve(leafCount * 2);
+
+	vector<int> todo(leafCount);
+	for (int i = 0; i < leafCount; i++)
+	{
+		todo[i] = i + 1;
+	}
+
+	int A = 0;
+	float costAB = 0;
+	int B = leafCount > 1 ? FindBestMatch(todo, A, costAB) : 0;
+
+	while (todo.size() > 1)
+	{
+		float costBC;
+		int C = FindBestMatch(todo, B, costBC);
+
+		if (costBC < costAB)
+		{
+			A = B, B = C, costAB = costBC;
+			continue;
+		}
+
+		// create a new cluster
+		LightCluster cluster = nodes[todo[A]];
+		cluster.bounds.Grow(nodes[todo[B]].bounds);
+		cluster.intensity += nodes[todo[B]].intensity;
+		cluster.left = todo[A];
+		cluster.right = todo[B];
+		cluster.light = -1;
+		nodes.push_back(cluster);
+
+		// delete A and B from 'todo', higher position first, and add the new cluster
+		todo.erase(todo.begin() + max(A, B));
+		todo.erase(todo.begin() + min(A, B));
+		todo.push_back((int)nodes.size() - 1);
+
+		// prepare search for next couple
+		A = (int)todo.size() - 1;
+		if (todo.size() > 1)
+		{
+			B = FindBestMatch(todo, A, costAB);
+		}
+	}
+
+	UpdateClusters();
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  LightTree::Refit                                                           |
+//  |  Updates the tree for lights that moved or changed intensity, keeping its   |
+//  |  topology. Only valid when the number of lights of each type is the same    |
+//  |  as at the last Build.                                                      |
+//  +-----------------------------------------------------------------------------+
+void LightTree::Refit(const vector<CoreLightTri>& triLights, const vector<CorePointLight>& pointLights, const vector<CoreSpotLight>& spotLights)
+{
+	for (int i = 0; i < (int)triLights.size(); i++)
+	{
+		nodes[i + 1] = LightCluster(triLights[i], i);
+		nodes[i + 1].N = triLights[i].N;
+	}
+
+	for (int i = 0; i < (int)pointLights.size(); i++)
+	{
+		nodes[i + 1 + triLightCount] = LightCluster(pointLights[i], i);
+	}
+
+	for (int i = 0; i < (int)spotLights.size(); i++)
+	{
+		nodes[i + 1 + triLightCount + pointLightCount] = LightCluster(spotLights[i], i);
+	}
+
+	UpdateClusters();
+}
+
+void LightTree::CreateLeaves(const vector<CoreLightTri>& triLights, const vector<CorePointLight>& pointLights, const vector<CoreSpotLight>& spotLights)
+{
+	triLightCount = (int)triLights.size();
+	pointLightCount = (int)pointLights.size();
+	leafCount = triLightCount + pointLightCount + (int)spotLights.size();
+
+	nodes.clear();
+	if (leafCount == 0)
+	{
+		return;
+	}
+
+	// the leaf for light i has index i + 1; node 0 is filled in with the root afterwards
+	nodes.resize(leafCount + 1);
+	Refit(triLights, pointLights, spotLights);
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  LightTree::UpdateClusters                                                  |
+//  |  Recomputes bounds, intensity and normal of every interior node from its    |
+//  |  children, and the parent links. Children always precede their parent in    |
+//  |  the node array, so one pass in order suffices. A cluster only gets a       |
+//  |  normal when the normals of its children are nearly parallel, as in         |
+//  |  UpdateLightTreeNormals.                                                    |
+//  +-----------------------------------------------------------------------------+
+void LightTree::UpdateClusters()
+{
+	for (int i = 1; i < (int)nodes.size(); i++)
+	{
+		LightCluster& node = nodes[i];
+		if (node.left == -1)
+		{
+			continue;
+		}
+
+		const LightCluster& left = nodes[node.left];
+		const LightCluster& right = nodes[node.right];
+		node.bounds = aabb::Union(left.bounds, right.bounds);
+		node.intensity = left.intensity + right.intensity;
+		node.N = dot(left.N, right.N) > 0.9f ? normalize(left.N + right.N) : make_float3(0);
+		nodes[node.left].parent = nodes[node.right].parent = i;
+	}
+
+	// put root in convenient place
+	nodes[0] = nodes.back();
+	if (nodes[0].left != -1)
+	{
+		nodes[nodes[0].left].parent = nodes[nodes[0].right].parent = 0;
+	}
+}
+
+int LightTree::FindBestMatch(const vector<int>& todo, int idx, float& bestCost) const
+{
+	int bestIdx = 0;
+	bestCost = 1e34f;
+
+	const LightCluster& cluster = nodes[todo[idx]];
+	for (int i = 0; i < (int)todo.size(); i++)
+	{
+		if (i == idx)
+		{
+			continue;
+		}
+
+		LightCluster tmp = cluster;
+		tmp.bounds.Grow(nodes[todo[i]].bounds);
+		tmp.intensity += nodes[todo[i]].intensity;
+		const float cost = tmp.Cost();
+
+		if (cost < bestCost)
+		{
+			bestCost = cost;
+			bestIdx = i;
+		}
+	}
+
+	return bestIdx;
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  LightTree::CalculateCosineBound                                            |
+//  |  Upper bound on the cosine at I towards any point of the cluster, using     |
+//  |  its bounding sphere; times the same bound at the emitter for clusters      |
+//  |  with a normal. The emitter term is never quite zero, since the normal of   |
+//  |  a cluster does not cover the spread of the normals below it.               |
+//  +-----------------------------------------------------------------------------+
+float LightTree::CalculateCosineBound(const LightCluster& cluster, const float3& I, const float3& N, float& centreDist2) const
+{
+	const float3 halfExtent = 0.5f * (cluster.bounds.bmax3 - cluster.bounds.bmin3);
+	const float3 D = 0.5f * (cluster.bounds.bmin3 + cluster.bounds.bmax3) - I;
+	const float radius2 = dot(halfExtent, halfExtent);
+	centreDist2 = max(dot(D, D), radius2);
+
+	if (dot(D, D) <= radius2)
+	{
+		return 1;
+	}
+
+	const float3 L = D * (1.0f / sqrtf(dot(D, D)));
+	const float sinAlpha = sqrtf(radius2 / dot(D, D));
+	const float cosAlpha = sqrtf(1 - sinAlpha * sinAlpha);
+
+	auto bound = [sinAlpha, cosAlpha](const float cosTheta)
+	{
+		if (cosTheta >= cosAlpha)
+		{
+			return 1.0f;
+		}
+
+		const float sinTheta = sqrtf(max(0.0f, 1 - cosTheta * cosTheta));
+		return max(0.0f, cosTheta * cosAlpha + sinTheta * sinAlpha);
+	};
+
+	float F = bound(dot(N, L));
+	if (dot(cluster.N, cluster.N) > 0)
+	{
+		F *= max(0.001f, bound(-dot(cluster.N, L)));
+	}
+
+	return F;
+}
+
+// Importance of a cluster based on the nearest and the farthest point of its bounds.
+void LightTree::CalculateWeights(const LightCluster& cluster, const float3& I, const float3& N, float& nearWeight, float& farWeight) const
+{
+	const float3 bmin = cluster.bounds.bmin3, bmax = cluster.bounds.bmax3;
+	const float3 nearest = fminf(fmaxf(I, bmin), bmax);
+	const float3 farthest = make_float3(
+		I.x - bmin.x > bmax.x - I.x ? bmin.x : bmax.x,
+		I.y - bmin.y > bmax.y - I.y ? bmin.y : bmax.y,
+		I.z - bmin.z > bmax.z - I.z ? bmin.z : bmax.z);
+	const float nearDist2 = max(1e-6f, dot(nearest - I, nearest - I));
+	const float farDist2 = max(1e-6f, dot(farthest - I, farthest - I));
+
+	float centreDist2;
+	const float F = cluster.intensity * CalculateCosineBound(cluster, I, N, centreDist2);
+	nearWeight = F / nearDist2;
+	farWeight = F / farDist2;
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  LightTree::LeftProb                                                        |
+//  |  Probability of descending into the left child of an interior node; the     |
+//  |  average of the probabilities based on the nearest and the farthest         |
+//  |  distance, as CalculateChildNodeWeights in lights_shared.h. Unlike the      |
+//  |  GPU version this is deterministic, so PickProb can recompute it.           |
+//  +-----------------------------------------------------------------------------+
+float LightTree::LeftProb(const LightCluster& node, const float3& I, const float3& N) const
+{
+	float leftNear, leftFar, rightNear, rightFar;
+	CalculateWeights(nodes[node.left], I, N, leftNear, leftFar);
+	CalculateWeights(nodes[node.right], I, N, rightNear, rightFar);
+
+	if (leftNear + rightNear <= 0)
+	{
+		// neither child can contribute; any choice will do
+		return 0.5f;
+	}
+
+	const float pNear = leftNear / (leftNear + rightNear);
+	const float pFar = leftFar + rightFar > 0 ? leftFar / (leftFar + rightFar) : pNear;
+	return 0.5f * (pNear + pFar);
+}
+
+// Importance of the whole tree, for choosing between it and the directional lights.
+float LightTree::Importance(const float3& I, const float3& N) const
+{
+	if (Empty())
+	{
+		return 0;
+	}
+
+	float centreDist2;
+	const float F = CalculateCosineBound(nodes[0], I, N, centreDist2);
+	return nodes[0].intensity * F / max(1e-6f, centreDist2);
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  LightTree::Sample                                                          |
+//  |  Descends from the root to a single light, choosing a child at every node   |
+//  |  with LeftProb; r is rescaled at every step and reused. Returns the light   |
+//  |  index and the probability of choosing it.                                  |
+//  +-----------------------------------------------------------------------------+
+int LightTree::Sample(float r, const float3& I, const float3& N, float& pickProb) const
+{
+	int nodeIdx = 0;
+	pickProb = 1;
+
+	while (nodes[nodeIdx].left != -1)
+	{
+		const LightCluster& node = nodes[nodeIdx];
+		const float p = LeftProb(node, I, N);
+
+		if (r < p)
+		{
+			r = min(r / p, 0.99999994f);
+			pickProb *= p;
+			nodeIdx = node.left;
+		}
+		else
+		{
+			r = min((r - p) / (1 - p), 0.99999994f);
+			pickProb *= 1 - p;
+			nodeIdx = node.right;
+		}
+	}
+
+	return LightIndex(nodes[nodeIdx]);
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  LightTree::PickProb                                                        |
+//  |  Probability that Sample returns the specified light, found by walking      |
+//  |  from its leaf up to the root.                                              |
+//  +-----------------------------------------------------------------------------+
+float LightTree::PickProb(int lightIdx, const float3& I, const float3& N) const
+{
+	float prob = 1;
+
+	for (int nodeIdx = lightIdx + 1; nodes[nodeIdx].parent != -1; nodeIdx = nodes[nodeIdx].parent)
+	{
+		const LightCluster& parent = nodes[nodes[nodeIdx].parent];
+		const float p = LeftProb(parent, I, N);
+		prob *= parent.left == nodeIdx ? p : 1 - p;
+	}
+
+	return prob;
+}
+
+// Index of the light of a leaf, undoing the type flags set by the LightCluster constructors.
+int LightTree::LightIndex(const LightCluster& leaf) const
+{
+	if (leaf.light & (1 << 30))
+	{
+		return triLightCount + (leaf.light & ~(1 << 30));
+	}
+
+	if (leaf.light & (1 << 29))
+	{
+		return triLightCount + pointLightCount + (leaf.light & ~(1 << 29));
+	}
+
+	return leaf.light;
+}
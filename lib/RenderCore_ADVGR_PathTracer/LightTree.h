@@ -0,0 +1,42 @@
+#pragma once
+#include "platform.h"
+
+using namespace lighthouse2;
+
+#include "core_api_base.h"
+
+//  +-----------------------------------------------------------------------------+
+//  |  LightTree                                                                  |
+//  |  Host light tree over the area, point and spot lights, built from the       |
+//  |  LightCluster nodes of common_classes.h in the same layout as the GPU       |
+//  |  cores: the leaf for light i is nodes[i + 1] and nodes[0] is a copy of the  |
+//  |  root. Light indices are those of Lights, without the directional lights.   |
+//  +-----------------------------------------------------------------------------+
+class LightTree
+{
+public:
+	void Build(const vector<CoreLightTri>& triLights, const vector<CorePointLight>& pointLights, const vector<CoreSpotLight>& spotLights);
+	void Refit(const vector<CoreLightTri>& triLights, const vector<CorePointLight>& pointLights, const vector<CoreSpotLight>& spotLights);
+	bool Empty() const { return nodes.empty(); }
+	int LightCount() const { return leafCount; }
+	bool HasLayout(int triCount, int pointCount, int spotCount) const { return triCount == triLightCount && pointCount == pointLightCount && triCount + pointCount + spotCount == leafCount; }
+	float Importance(const float3& I, const float3& N) const;
+	int Sample(float r, const float3& I, const float3& N, float& pickProb) const;
+	float PickProb(int lightIdx, const float3& I, const float3& N) const;
+
+public:
+	vector<LightCluster> nodes;
+
+private:
+	void CreateLeaves(const vector<CoreLightTri>& triLights, const vector<CorePointLight>& pointLights, const vector<CoreSpotLight>& spotLights);
+	void UpdateClusters();
+	int FindBestMatch(const vector<int>& todo, int idx, float& bestCost) const;
+	float LeftProb(const LightCluster& node, const float3& I, const float3& N) const;
+	void CalculateWeights(const LightCluster& cluster, const float3& I, const float3& N, float& nearWeight, float& farWeight) const;
+	float CalculateCosineBound(const LightCluster& cluster, const float3& I, const float3& N, float& centreDist2) const;
+	int LightIndex(const LightCluster& leaf) const;
+
+	int leafCount = 0;
+	int triLightCount = 0;
+	int pointLightCount = 0;
+};
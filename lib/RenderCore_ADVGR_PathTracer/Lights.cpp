@@ -0,0 +1,224 @@
+#include "Lights.h"
+
+void Lights::Set(const CoreLightTri* triLightData, const int triLightCount,
+	const CorePointLight* pointLightData, const int pointLightCount,
+	const CoreSpotLight* spotLightData, const int spotLightCount,
+	const CoreDirectionalLight* directionalLightData, const int directionalLightCount)
+{
+	triLights.assign(triLightData, triLightData + triLightCount);
+	pointLights.assign(pointLightData, pointLightData + pointLightCount);
+	spotLights.assign(spotLightData, spotLightData + spotLightCount);
+	directionalLights.assign(directionalLightData, directionalLightData + directionalLightCount);
+
+	// lights that only moved or changed keep the topology of the tree
+	if (!tree.Empty() && tree.HasLayout(triLightCount, pointLightCount, spotLightCount))
+	{
+		tree.Refit(triLights, pointLights, spotLights);
+	}
+	else
+	{
+		tree.Build(triLights, pointLights, spotLights);
+	}
+}
+
+int Lights::Count() const
+{
+	return (int)(triLights.size() + pointLights.size() + spotLights.size() + directionalLights.size());
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  Lights::PotentialContribution                                              |
+//  |  Unshadowed estimate of what a light adds to point I with normal N; the     |
+//  |  Potential*LightContribution functions of lights_shared.h. Area lights      |
+//  |  are always evaluated at their centre, so picking a light and computing     |
+//  |  the probability of that pick for MIS give the same answer.                 |
+//  +-----------------------------------------------------------------------------+
+float Lights::PotentialContribution(int lightIdx, const float3& I, const float3& N) const
+{
+	if (lightIdx < (int)triLights.size())
+	{
+		const CoreLightTri& light = triLights[lightIdx];
+		float3 L = light.centre - I;
+		const float att = 1.0f / dot(L, L);
+		L = normalize(L);
+		const float LNdotL = max(0.0f, -dot(light.N, L));
+		const float NdotL = max(0.0f, dot(N, L));
+		return light.energy * LNdotL * NdotL * att;
+	}
+
+	lightIdx -= (int)triLights.size();
+	if (lightIdx < (int)pointLights.size())
+	{
+		const CorePointLight& light = pointLights[lightIdx];
+		const float3 L = light.position - I;
+		const float NdotL = max(0.0f, dot(N, normalize(L)));
+		const float att = 1.0f / dot(L, L);
+		return light.energy * NdotL * att;
+	}
+
+	lightIdx -= (int)pointLights.size();
+	if (lightIdx < (int)spotLights.size())
+	{
+		const CoreSpotLight& light = spotLights[lightIdx];
+		float3 L = light.position - I;
+		const float att = 1.0f / dot(L, L);
+		L = normalize(L);
+		const float d = (max(0.0f, -dot(L, light.direction)) - light.cosOuter) / (light.cosInner - light.cosOuter);
+		const float NdotL = max(0.0f, dot(N, L));
+		const float LNdotL = max(0.0f, min(1.0f, d));
+		return (light.radiance.x + light.radiance.y + light.radiance.z) * LNdotL * NdotL * att;
+	}
+
+	lightIdx -= (int)spotLights.size();
+	const CoreDirectionalLight& light = directionalLights[lightIdx];
+	const float LNdotL = max(0.0f, -dot(light.direction, N));
+	return light.energy * LNdotL;
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  Lights::LightPickProb                                                      |
+//  |  Probability that RandomPointOnLight picks the specified light from point   |
+//  |  I with normal N. Used for MIS when a BSDF sample hits an area light.       |
+//  +-----------------------------------------------------------------------------+
+float Lights::LightPickProb(int lightIdx, const float3& I, const float3& N) const
+{
+	const float treeImportance = tree.Importance(I, N);
+	float sum = treeImportance;
+	for (int i = tree.LightCount(); i < Count(); i++)
+	{
+		sum += PotentialContribution(i, I, N);
+	}
+
+	if (sum <= 0)
+	{
+		return 0;
+	}
+
+	if (lightIdx < tree.LightCount())
+	{
+		return treeImportance / sum * tree.PickProb(lightIdx, I, N);
+	}
+
+	return PotentialContribution(lightIdx, I, N) / sum;
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  Lights::RandomPointOnLight                                                 |
+//  |  Picks a light and a point on it. The light tree and the directional        |
+//  |  lights are chosen between with a probability proportional to their         |
+//  |  importance; the tree then descends to a single light. Returns the point,   |
+//  |  the pick probability, the solid angle pdf of the point, and the light      |
+//  |  colour. Point, spot and directional lights can not be hit by a BSDF        |
+//  |  sample; isDelta tells the caller that MIS does not apply.                  |
+//  +-----------------------------------------------------------------------------+
+float3 Lights::RandomPointOnLight(float r0, float r1, const float3& I, const float3& N, float& pickProb, float& lightPdf, float3& lightColor, bool& isDelta) const
+{
+	const int lightCount = Count();
+	lightPdf = 0;
+
+	const float treeImportance = tree.Importance(I, N);
+	float sum = treeImportance;
+	for (int i = tree.LightCount(); i < lightCount; i++)
+	{
+		sum += PotentialContribution(i, I, N);
+	}
+
+	if (sum <= 0)
+	{
+		// no potential lights found; light direction, don't return 0 or nan
+		return I + make_float3(1);
+	}
+
+	int lightIdx = 0;
+	r1 *= sum;
+	if (r1 < treeImportance || lightCount == tree.LightCount())
+	{
+		lightIdx = tree.Sample(min(r1 / treeImportance, 0.99999994f), I, N, pickProb);
+		pickProb *= treeImportance / sum;
+	}
+	else
+	{
+		// Rounding may leave r1 just above the total; the last directional light with
+		// a potential is taken then.
+		float total = treeImportance;
+		for (int i = tree.LightCount(); i < lightCount; i++)
+		{
+			const float potential = PotentialContribution(i, I, N);
+			if (potential <= 0)
+			{
+				continue;
+			}
+
+			lightIdx = i;
+			pickProb = potential / sum;
+			total += potential;
+			if (total >= r1)
+			{
+				break;
+			}
+		}
+	}
+
+	if (lightIdx < (int)triLights.size())
+	{
+		// pick an area light
+		const CoreLightTri& light = triLights[lightIdx];
+		const float3 bary = RandomBarycentrics(r0);
+		const float3 P = bary.x * light.vertex0 + bary.y * light.vertex1 + bary.z * light.vertex2;
+		float3 L = I - P; // reversed: from light to intersection point
+		const float sqDist = dot(L, L);
+		L = normalize(L);
+		const float LNdotL = dot(L, light.N);
+		lightPdf = (LNdotL > 0 && dot(L, N) < 0) ? sqDist / (light.area * LNdotL) : 0;
+		lightColor = light.radiance;
+		isDelta = false;
+		return P;
+	}
+
+	lightIdx -= (int)triLights.size();
+	isDelta = true;
+	if (lightIdx < (int)pointLights.size())
+	{
+		// pick a pointlight
+		const CorePointLight& light = pointLights[lightIdx];
+		const float3 L = light.position - I;
+		lightColor = light.radiance / dot(L, L);
+		lightPdf = dot(L, N) > 0 ? 1 : 0;
+		return light.position;
+	}
+
+	lightIdx -= (int)pointLights.size();
+	if (lightIdx < (int)spotLights.size())
+	{
+		// pick a spotlight
+		const CoreSpotLight& light = spotLights[lightIdx];
+		float3 L = I - light.position;
+		const float sqDist = dot(L, L);
+		L = normalize(L);
+		const float d = (max(0.0f, dot(L, light.direction)) - light.cosOuter) / (light.cosInner - light.cosOuter);
+		const float LNdotL = min(1.0f, d);
+		lightPdf = (LNdotL > 0 && dot(L, N) < 0) ? (sqDist / LNdotL) : 0;
+		lightColor = light.radiance;
+		return light.position;
+	}
+
+	// pick a directional light
+	lightIdx -= (int)spotLights.size();
+	const CoreDirectionalLight& light = directionalLights[lightIdx];
+	lightColor = light.radiance;
+	lightPdf = dot(light.direction, N) < 0 ? 1 : 0;
+	return I - 1000.0f * light.direction;
+}
+
+// Index of the area light for an emissive triangle; -1 if the triangle does not emit. As in the
+// GPU cores this is CoreTri::ltriIdx, which the host sets to the index in its list of area lights.
+int Lights::FindTriLight(const CoreTri& tri) const
+{
+	return tri.ltriIdx < (int)triLights.size() ? tri.ltriIdx : -1;
+}
+
+// Converts the area pdf of a point on a light to a pdf over the solid angle.
+float Lights::CalculateLightPDF(const float3& D, const float t, const float lightArea, const float3& lightNormal)
+{
+	return (t * t) / (abs(dot(D, lightNormal)) * lightArea);
+}
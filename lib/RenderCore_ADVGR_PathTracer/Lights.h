@@ -0,0 +1,38 @@
+#pragma once
+#include "platform.h"
+
+using namespace lighthouse2;
+
+#include "core_api_base.h"
+#include "LightTree.h"
+
+//  +-----------------------------------------------------------------------------+
+//  |  Lights                                                                     |
+//  |  Host copy of the scene lights, with the light selection and sampling of    |
+//  |  CUDA/shared_kernel_code/lights_shared.h for next event estimation. All     |
+//  |  lights share one index: area lights first, then point, spot and            |
+//  |  directional lights, as in the GPU cores. Area, point and spot lights are   |
+//  |  picked through a light tree, so the cost of a pick grows with the log of   |
+//  |  the number of lights; directional lights are weighed against the tree.     |
+//  +-----------------------------------------------------------------------------+
+class Lights
+{
+public:
+	void Set(const CoreLightTri* triLights, const int triLightCount,
+		const CorePointLight* pointLights, const int pointLightCount,
+		const CoreSpotLight* spotLights, const int spotLightCount,
+		const CoreDirectionalLight* directionalLights, const int directionalLightCount);
+	int Count() const;
+	float PotentialContribution(int lightIdx, const float3& I, const float3& N) const;
+	float LightPickProb(int lightIdx, const float3& I, const float3& N) const;
+	float3 RandomPointOnLight(float r0, float r1, const float3& I, const float3& N, float& pickProb, float& lightPdf, float3& lightColor, bool& isDelta) const;
+	int FindTriLight(const CoreTri& tri) const;
+	static float CalculateLightPDF(const float3& D, const float t, const float lightArea, const float3& lightNormal);
+
+public:
+	vector<CoreLightTri> triLights;
+	vector<CorePointLight> pointLights;
+	vector<CoreSpotLight> spotLights;
+	vector<CoreDirectionalLight> directionalLights;
+	LightTree tree;
+};
@@ -0,0 +1,46 @@
+#pragma once
+#include "Ray.h"
+#include "Sampler.h"
+
+//  +-----------------------------------------------------------------------------+
+//  |  PathState                                                                  |
+//  |  Everything a path needs between two stages of the wavefront loop. The      |
+//  |  throughput is the product of all surface interactions so far; whatever     |
+//  |  light the path finds is scaled by it and added to its own pixel.           |
+//  +-----------------------------------------------------------------------------+
+struct PathState
+{
+	Ray ray;
+	float3 throughput;
+	int pixelIdx;
+	int depth;
+	// Set when the last bounce was a mirror or glass, which NEE can not account for.
+	bool specular;
+	// Pdf of the last diffuse bounce and the normal it left from, for MIS on light hits.
+	float bsdfPdf;
+	float3 lastN;
+	Sampler sampler;
+};
+
+//  +-----------------------------------------------------------------------------+
+//  |  ExtensionHit                                                               |
+//  |  Closest intersection found by the extend stage. On top of the TLAS hit,    |
+//  |  one of the analytic spheres may be closest instead.                        |
+//  +-----------------------------------------------------------------------------+
+struct ExtensionHit : HitRecord
+{
+	int sphereIdx = -1;
+};
+
+//  +-----------------------------------------------------------------------------+
+//  |  ShadowRay                                                                  |
+//  |  Connection to a light created by the shade stage. The connect stage adds   |
+//  |  contribution to the pixel when nothing blocks the ray before tMax.         |
+//  +-----------------------------------------------------------------------------+
+struct ShadowRay
+{
+	Ray ray;
+	float tMax;
+	float3 contribution;
+	int pixelIdx;
+};
@@ -0,0 +1,91 @@
+#include "Sampler.h"
+#include "common_bluenoise.h"
+
+bool Sampler::useBlueNoise = true;
+vector<uint> Sampler::blueNoise;
+
+// Hash of the pixel and sample index, so that neighbouring seeds give unrelated streams.
+static uint WangHash(uint s)
+{
+	s = (s ^ 61) ^ (s >> 16);
+	s *= 9;
+	s = s ^ (s >> 4);
+	s *= 0x27d4eb2d;
+	s = s ^ (s >> 15);
+	return s;
+}
+
+Sampler::Sampler(int x, int y, uint sampleIdx) : x(x), y(y), sampleIdx(sampleIdx)
+{
+	seed = WangHash(x * 1973 + y * 9277 + sampleIdx * 26699) | 1;
+}
+
+float Sampler::Next()
+{
+	int d = dimension++;
+
+	if (useBlueNoise && sampleIdx < 256 && d < BLUENOISE_DIMENSIONS && !blueNoise.empty())
+	{
+		return BlueNoise(x, y, sampleIdx, d);
+	}
+
+	return RandomFloat();
+}
+
+uint Sampler::RandomUInt()
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+float Sampler::RandomFloat()
+{
+	// 24 random bits, so the result is strictly below 1.
+	return (RandomUInt() >> 8) * (1.0f / 16777216.0f);
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  Sampler::InitBlueNoise                                                     |
+//  |  Unpacks the 8-bit blue noise tables, in the same layout as the GPU cores.  |
+//  +-----------------------------------------------------------------------------+
+void Sampler::InitBlueNoise()
+{
+	if (!blueNoise.empty())
+	{
+		return;
+	}
+
+	blueNoise.resize(65536 * 5);
+
+	const uchar* data8 = (const uchar*)sob256_64;
+	for (int i = 0; i < 65536; i++) blueNoise[i] = data8[i];
+	data8 = (const uchar*)scr256_64;
+	for (int i = 0; i < (128 * 128 * 8); i++) blueNoise[i + 65536] = data8[i];
+	data8 = (const uchar*)rnk256_64;
+	for (int i = 0; i < (128 * 128 * 8); i++) blueNoise[i + 3 * 65536] = data8[i];
+}
+
+float Sampler::BlueNoise(int x, int y, int sampleIdx, int dimension)
+{
+	// Adapted from E. Heitz, as blueNoiseSampler in the GPU cores.
+	// The scrambling and ranking tables hold BLUENOISE_DIMENSIONS entries per pixel.
+	x &= 127, y &= 127, sampleIdx &= 255, dimension &= BLUENOISE_DIMENSIONS - 1;
+	// xor index based on optimized ranking
+	int rankedSampleIndex = (sampleIdx ^ blueNoise[dimension + (x + y * 128) * BLUENOISE_DIMENSIONS + 65536 * 3]) & 255;
+	// fetch value in sequence
+	int value = blueNoise[dimension + rankedSampleIndex * 256];
+	// xor sequence value based on optimized scrambling
+	value ^= blueNoise[dimension + (x + y * 128) * BLUENOISE_DIMENSIONS + 65536];
+	return (0.5f + value) * (1.0f / 256.0f);
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  Sampler::CosineWeightedHemisphere                                          |
+//  |  Maps two uniform numbers to a direction around N with pdf cos(theta)/pi.   |
+//  +-----------------------------------------------------------------------------+
+float3 Sampler::CosineWeightedHemisphere(const float3& N, float r0, float r1)
+{
+	return Tangent2World(DiffuseReflectionCosWeighted(r0, r1), N);
+}
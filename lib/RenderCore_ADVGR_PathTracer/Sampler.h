@@ -0,0 +1,44 @@
+#pragma once
+#include "platform.h"
+
+using namespace lighthouse2;
+
+#include "core_api_base.h"
+
+//  +-----------------------------------------------------------------------------+
+//  |  Sampler                                                                    |
+//  |  Random numbers for a single path. The state is derived from the pixel      |
+//  |  and sample index only, so a path draws the same numbers no matter which    |
+//  |  thread traces it or in what order, and an image can be reproduced.         |
+//  |  Every call to Next() moves on to the next dimension of the sample. The     |
+//  |  first 8 dimensions come from the blue noise tables of E. Heitz for the     |
+//  |  first 256 samples, when enabled; everything else uses xorshift32.          |
+//  +-----------------------------------------------------------------------------+
+class Sampler
+{
+public:
+	Sampler() = default;
+	Sampler(int x, int y, uint sampleIdx);
+
+	float Next();
+	uint RandomUInt();
+	float RandomFloat();
+
+	static void InitBlueNoise();
+	static float BlueNoise(int x, int y, int sampleIdx, int dimension);
+	static float3 CosineWeightedHemisphere(const float3& N, float r0, float r1);
+
+	// Number of dimensions per sample served from the blue noise tables: the Sobol table has
+	// 256, but the scrambling and ranking tables are only optimized for the first 8.
+	static constexpr int BLUENOISE_DIMENSIONS = 8;
+	static bool useBlueNoise;
+
+private:
+	int x, y;
+	uint sampleIdx;
+	int dimension = 0;
+	uint seed;
+
+	// Sobol, scrambling and ranking tables, one uint per entry.
+	static vector<uint> blueNoise;
+};
@@ -20,6 +20,9 @@
 
 #pragma once
 
+// core-specific settings
+#define BATCHSIZE	256		// paths handed to a worker at a time in each wavefront stage
+
 #include "platform.h"
 
 using namespace lighthouse2;
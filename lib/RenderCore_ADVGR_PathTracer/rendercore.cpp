@@ -58,11 +58,15 @@ void RenderCore::Init()
 	m_spheres.push_back(mirrorSphere);
 	m_spheres.push_back(glassSphere);
 
-	CoreLightTri coreTriLight{};
-	coreTriLight.area = 5;
-	coreTriLight.centre = make_float3(0, 8, 3);
+	// Lights up scenes that bring no lights of their own; about as bright as the white
+	// sphere of radius 5 that used to hang here.
+	defaultLight.position = make_float3(0, 8, 3);
+	defaultLight.radiance = make_float3(25 * PI);
+	defaultLight.energy = 75 * PI;
 
-	m_coreTriLight.push_back(coreTriLight);
+	lights.Set(0, 0, &defaultLight, 1, 0, 0, 0, 0);
+
+	Sampler::InitBlueNoise();
 }
 
 //  +-----------------------------------------------------------------------------+
@@ -84,139 +88,353 @@ void RenderCore::SetTarget( GLTexture* target, const uint )
 //  +-----------------------------------------------------------------------------+
 void RenderCore::SetGeometry( const int meshIdx, const float4* vertexData, const int vertexCount, const int triangleCount, const CoreTri* triangleData )
 {
-	Mesh newMesh;
-	// copy the supplied vertices; we cannot assume that the render system does not modify
-	// the original data after we leave this function.
-	newMesh.vertices = new float4[vertexCount];
-	newMesh.vcount = vertexCount;
-	memcpy(newMesh.vertices, vertexData, vertexCount * sizeof(float4));
-	// copy the supplied 'fat triangles'
-	newMesh.triangles = new CoreTri[vertexCount / 3];
-	memcpy(newMesh.triangles, triangleData, (vertexCount / 3) * sizeof(CoreTri));
-	meshes.push_back(newMesh);
+	if (meshIdx >= (int)meshes.size())
+	{
+		meshes.resize(meshIdx + 1);
+		blas.resize(meshIdx + 1, 0);
+	}
+
+	Mesh& newMesh = meshes[meshIdx];
+
+	// Same triangles at new positions: update in place and refit, unless the BVH degraded too much.
+	if (blas[meshIdx] != 0 && newMesh.vcount == vertexCount)
+	{
+		memcpy(newMesh.vertices, vertexData, vertexCount * sizeof(float4));
+		memcpy(newMesh.triangles, triangleData, (vertexCount / 3) * sizeof(CoreTri));
+
+		if (blas[meshIdx]->Refit())
+		{
+			instancesDirty = true;
+			return;
+		}
+	}
+	else
+	{
+		// replace the previous data for this mesh index, if any
+		delete[] newMesh.vertices;
+		delete[] newMesh.triangles;
+		// copy the supplied vertices; we cannot assume that the render system does not modify
+		// the original data after we leave this function.
+		newMesh.vertices = new float4[vertexCount];
+		newMesh.vcount = vertexCount;
+		memcpy(newMesh.vertices, vertexData, vertexCount * sizeof(float4));
+		// copy the supplied 'fat triangles'
+		newMesh.triangles = new CoreTri[vertexCount / 3];
+		memcpy(newMesh.triangles, triangleData, (vertexCount / 3) * sizeof(CoreTri));
+	}
+
+	delete blas[meshIdx];
+	blas[meshIdx] = new BVH();
+	blas[meshIdx]->binCount = bvhBins;
+	blas[meshIdx]->wide = bvhWidth == 4;
+	blas[meshIdx]->ConstructBVH(newMesh);
+
+	// the tlas refers to the old blas
+	instancesDirty = true;
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  RenderCore::SetInstance                                                    |
+//  |  Set instance details.                                                LH2'19|
+//  +-----------------------------------------------------------------------------+
+void RenderCore::SetInstance( const int instanceIdx, const int meshIdx, const mat4& matrix )
+{
+	// A '-1' mesh denotes the end of the instance stream;
+	// adjust the instances vector if we have more.
+	if (meshIdx == -1)
+	{
+		if (instances.size() > instanceIdx) instances.resize( instanceIdx );
+		instancesDirty = true;
+		return;
+	}
+	// For the first frame, instances are added to the instances vector.
+	// For subsequent frames existing slots are overwritten / updated.
+	if (instanceIdx >= instances.size()) instances.resize( instanceIdx + 1 );
+	instances[instanceIdx].meshIdx = meshIdx;
+	instances[instanceIdx].transform = matrix;
+	instances[instanceIdx].invTransform = matrix.Inverted();
+	instancesDirty = true;
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  RenderCore::FinalizeInstances                                              |
+//  |  Rebuild the top-level BVH when instances or meshes changed.                |
+//  +-----------------------------------------------------------------------------+
+void RenderCore::FinalizeInstances()
+{
+	if (!instancesDirty)
+	{
+		return;
+	}
+
+	tlas.bvh.binCount = bvhBins;
+	tlas.Build(instances, blas);
+	instancesDirty = false;
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  ParallelFor                                                                |
+//  |  Calls body(i) for all i in [0, count) on every worker of the executor.     |
+//  |  Indices are handed out in batches of BATCHSIZE, so the threads that get    |
+//  |  cheap paths pick up the slack of the ones bouncing around in glass.        |
+//  +-----------------------------------------------------------------------------+
+template <class Body> static void ParallelFor(tf::Executor& executor, int count, const Body& body)
+{
+	atomic<int> next{ 0 };
+	tf::Taskflow taskflow;
+	for (size_t i = 0; i < executor.num_workers(); i++)
+	{
+		taskflow.emplace([&]()
+		{
+			for (int first = next.fetch_add(BATCHSIZE); first < count; first = next.fetch_add(BATCHSIZE))
+			{
+				for (int j = first; j < min(first + BATCHSIZE, count); j++)
+				{
+					body(j);
+				}
+			}
+		});
+	}
+	executor.run(taskflow).wait();
 }
 
 //  +-----------------------------------------------------------------------------+
 //  |  RenderCore::Render                                                         |
-//  |  Produce one image.                                                   LH2'19|
+//  |  Adds one sample per pixel to the accumulator. Paths are advanced one       |
+//  |  bounce at a time for all pixels together: generate the primary rays,       |
+//  |  then extend (find the nearest hit), shade (emit light, pick the next       |
+//  |  direction) and connect (trace shadow rays) until no path is left. Paths    |
+//  |  that survive a bounce are compacted into the next wave.                    |
 //  +-----------------------------------------------------------------------------+
 void RenderCore::Render( const ViewPyramid& view, const Convergence converge, bool async )
 {
+	// a camera move or scene change invalidates everything gathered so far
+	if (converge == Restart || samplesTaken == 0)
+	{
+		memset( accumulator, 0, sizeof( accumulator ) );
+		samplesTaken = 0;
+	}
+
+	const int pixelCount = SCRWIDTH * SCRHEIGHT;
+
+	if ((int)paths.size() < pixelCount)
+	{
+		paths.resize(pixelCount);
+		nextPaths.resize(pixelCount);
+		hits.resize(pixelCount);
+		shadowRays.resize(pixelCount);
+	}
+
 	float dx = 1.0f / (SCRWIDTH - 1);
 	float dy = 1.0f / (SCRHEIGHT - 1);
 
-	// render
-	for (int y = 0; y < SCRHEIGHT; y++)
+	// generate
+	ParallelFor(executor, pixelCount, [&](int pixelIdx)
 	{
-		for (int x = 0; x < SCRWIDTH; x++)
+		int x = pixelIdx % SCRWIDTH;
+		int y = pixelIdx / SCRWIDTH;
+
+		PathState& path = paths[pixelIdx];
+		path.sampler = Sampler(x, y, samplesTaken);
+
+		// jitter within the pixel so that accumulated samples also filter the edges
+		float jitterX = path.sampler.Next() - 0.5f;
+		float jitterY = path.sampler.Next() - 0.5f;
+
+		// screen width
+		float3 sx = (x + jitterX) * dx * (view.p2 - view.p1);
+		// screen height
+		float3 sy = (y + jitterY) * dy * (view.p3 - view.p1);
+		// point on the screen
+		float3 point = view.p1 + sx + sy;
+
+		path.ray = Ray(view.pos, normalize(point - view.pos));
+		path.ray.m_ConeSpread = view.spreadAngle;
+		path.throughput = make_float3(1);
+		path.pixelIdx = pixelIdx;
+		path.depth = 0;
+		path.specular = false;
+	});
+
+	int pathCount = pixelCount;
+
+	while (pathCount > 0)
+	{
+		// extend
+		ParallelFor(executor, pathCount, [&](int i)
+		{
+			hits[i] = Intersect(paths[i].ray);
+		});
+
+		// shade
+		atomic<int> nextCount{ 0 };
+		atomic<int> shadowCount{ 0 };
+		ParallelFor(executor, pathCount, [&](int i)
 		{
-			// screen width
-			float3 sx = x * dx * (view.p2 - view.p1);
-			// screen height
-			float3 sy = y * dy * (view.p3 - view.p1);
-			// point on the screen
-			float3 point = view.p1 + sx + sy;
-			// direction
-			float3 direction = normalize(point - view.pos);
-
-			ray.t = INT_MAX;
-			ray.m_Origin = view.pos;
-			ray.m_Direction = direction;
-			firstTimeMatteHit = 0;
-
-			float3 color = screenData[x + y * SCRWIDTH];
-
-			if (color.x == 0 && color.y == 0 && color.z == 0)
+			ShadowRay shadowRay;
+			shadowRay.pixelIdx = -1;
+
+			if (Shade(paths[i], hits[i], shadowRay))
 			{
-				screenData[x + y * SCRWIDTH] = Trace(ray, 0, x, y);
+				nextPaths[nextCount++] = paths[i];
 			}
-		}
-	}
 
-	for (int i = 0; i < SCRWIDTH * SCRHEIGHT; i++)
-	{
-		float3 p = screenData[i];
+			if (shadowRay.pixelIdx != -1)
+			{
+				shadowRays[shadowCount++] = shadowRay;
+			}
+		});
 
-		int red = clamp((int)(p.x * 256), 0, 255);
-		int green = clamp((int)(p.y * 256), 0, 255);
-		int blue = clamp((int)(p.z * 256), 0, 255);
+		// connect; every path has at most one shadow ray per wave, so pixels are not shared
+		ParallelFor(executor, shadowCount, [&](int i)
+		{
+			const ShadowRay& shadowRay = shadowRays[i];
 
-		screenPixels[i] = (blue << 16) + (green << 8) + red;
+			if (!IsOccluded(shadowRay.ray.m_Origin, shadowRay.ray.m_Direction, shadowRay.tMax))
+			{
+				Accumulate(shadowRay.pixelIdx, shadowRay.contribution);
+			}
+		});
+
+		swap(paths, nextPaths);
+		pathCount = nextCount;
 	}
 
+	samplesTaken++;
+	Display();
+
 	// copy pixel buffer to OpenGL render target texture
 	glBindTexture( GL_TEXTURE_2D, targetTextureID );
 	glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, SCRWIDTH, SCRHEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, screenPixels);
 }
 
-tuple<CoreTri*, float, float3, CoreMaterial, bool> RenderCore::Intersect(Ray ray)
+//  +-----------------------------------------------------------------------------+
+//  |  RenderCore::Display                                                        |
+//  |  Averages the accumulator into 8-bit RGBA, four pixels per iteration.       |
+//  +-----------------------------------------------------------------------------+
+void RenderCore::Display()
 {
-	float t_min = numeric_limits<float>::max();
-	bool isLight = false;
-	CoreTri* tri;
-	CoreMaterial coreMaterial;
-	float3 normal = make_float3(0);
+	static_assert((SCRWIDTH * SCRHEIGHT) % 4 == 0, "Display converts four pixels at a time");
 
-	for (Mesh& mesh : meshes) {
-		for (int i = 0; i < mesh.vcount / 3; i++) {
-			
-			float t = Utils::IntersectTriangle(ray, mesh.triangles[i].vertex0, mesh.triangles[i].vertex1, mesh.triangles[i].vertex2);
-			
-			if (t < t_min)
-			{
-				t_min = t;
-				tri = &mesh.triangles[i];
-				coreMaterial = materials[tri->material];
-				normal = make_float3(tri->Nx, tri->Ny, tri->Nz);
-			}
+	const __m128 scale = _mm_set1_ps(256.0f / samplesTaken);
+	const __m128 zero = _mm_setzero_ps(), limit = _mm_set1_ps(255.0f);
+
+	for (int i = 0; i < SCRWIDTH * SCRHEIGHT; i += 4)
+	{
+		__m128i p[4];
+		for (int j = 0; j < 4; j++)
+		{
+			__m128 c = _mm_mul_ps(_mm_load_ps(&accumulator[i + j].x), scale);
+			p[j] = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(c, zero), limit));
 		}
+
+		// 32 -> 16 -> 8 bits per channel; red ends up in the lowest byte of each pixel
+		__m128i rgba = _mm_packus_epi16(_mm_packs_epi32(p[0], p[1]), _mm_packs_epi32(p[2], p[3]));
+		_mm_storeu_si128((__m128i*)(screenPixels + i), rgba);
 	}
+}
 
-	for (auto& sphere : m_spheres)
+void RenderCore::Accumulate(int pixelIdx, const float3& color)
+{
+	float4& pixel = accumulator[pixelIdx];
+	pixel.x += color.x, pixel.y += color.y, pixel.z += color.z;
+}
+
+ExtensionHit RenderCore::Intersect(const Ray& ray)
+{
+	ExtensionHit hit;
+	tlas.Intersect(ray, hit);
+
+	for (int i = 0; i < (int)m_spheres.size(); i++)
 	{
-		float t = Utils::IntersectSphere(ray, sphere);
+		float t = Utils::IntersectSphere(ray, m_spheres[i]);
 
-		if (t < t_min)
+		if (t < hit.t)
 		{
-			t_min = t;
-			coreMaterial = sphere.m_Material;
-			normal = normalize((ray.m_Origin + ray.m_Direction * t_min) - sphere.m_CenterPosition);
+			hit.t = t;
+			hit.sphereIdx = i;
 		}
 	}
 
-	for (auto& light : m_coreTriLight)
-	{
-		Sphere sphere;
-		sphere.m_CenterPosition = light.centre;
-		sphere.m_Radius = light.area;
+	return hit;
+}
 
-		float t = Utils::IntersectSphere(ray, sphere);
+//  +-----------------------------------------------------------------------------+
+//  |  RenderCore::ResolveHit                                                     |
+//  |  Fetches the shading data for the primitive found by the extend stage.      |
+//  |  The barycentrics of the hit give the interpolated normal and texture       |
+//  |  coordinates.                                                               |
+//  +-----------------------------------------------------------------------------+
+tuple<CoreTri, float3, CoreMaterial, float2> RenderCore::ResolveHit(const Ray& ray, const ExtensionHit& hit)
+{
+	CoreTri tri;
+	CoreMaterial coreMaterial;
+	float3 normal = make_float3(0);
+	float2 uv = make_float2(0);
 
-		if (t < t_min)
+	if (hit.sphereIdx != -1)
+	{
+		const Sphere& sphere = m_spheres[hit.sphereIdx];
+		coreMaterial = sphere.m_Material;
+		normal = normalize((ray.m_Origin + ray.m_Direction * hit.t) - sphere.m_CenterPosition);
+	}
+	else
+	{
+		const BVHInstance& instance = tlas.instances[hit.instIdx];
+		tri = meshes[instance.meshIdx].triangles[hit.triIdx];
+		coreMaterial = materials[tri.material];
+
+		const float w = 1 - hit.u - hit.v;
+		uv = make_float2(w * tri.u0 + hit.u * tri.u1 + hit.v * tri.u2, w * tri.v0 + hit.u * tri.v1 + hit.v * tri.v2);
+		float3 N = w * tri.vN0 + hit.u * tri.vN1 + hit.v * tri.vN2;
+		if (dot(N, N) == 0)
 		{
-			t_min = t;
-			normal = normalize((ray.m_Origin + ray.m_Direction * t_min) - sphere.m_CenterPosition);
-			isLight = true;
-			coreMaterial.color.textureID = -1;
+			N = make_float3(tri.Nx, tri.Ny, tri.Nz);
 		}
+
+		// Shading happens in world space.
+		tri.vertex0 = instance.transform.TransformPoint(tri.vertex0);
+		tri.vertex1 = instance.transform.TransformPoint(tri.vertex1);
+		tri.vertex2 = instance.transform.TransformPoint(tri.vertex2);
+		normal = normalize(instance.invTransform.Transposed().TransformVector(N));
 	}
 
-	return make_tuple(tri, t_min, normal, coreMaterial, isLight);
+	return make_tuple(tri, normal, coreMaterial, uv);
 }
 
-float3 RenderCore::Trace(Ray ray, int depth, int x, int y)
+bool RenderCore::IsOccluded(float3 origin, float3 direction, float tMax)
 {
-	tuple intersect = Intersect(ray);
+	Ray shadowRay(origin, direction);
 
-	float t_min = get<1>(intersect);
-	float3 normalVector = get<2>(intersect);
-	CoreMaterial material = get<3>(intersect);
-	bool hitLight = get<4>(intersect);
+	// Stop at the first blocker; light stand-ins never occlude.
+	if (tlas.IsOccluded(shadowRay, tMax))
+	{
+		return true;
+	}
 
-	float3 color = make_float3(material.color.value.x, material.color.value.y, material.color.value.z);
-	float3 intersectionPoint = ray.m_Origin + ray.m_Direction * t_min;
+	for (auto& sphere : m_spheres)
+	{
+		if (Utils::IntersectSphere(shadowRay, sphere) < tMax)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  RenderCore::Shade                                                          |
+//  |  Handles the hit of a single path: adds any light it found to its pixel     |
+//  |  and sets up the ray for the next bounce. Returns false when the path       |
+//  |  ends here. A connection to a light may be stored in shadowRay, which is    |
+//  |  left untouched otherwise.                                                  |
+//  +-----------------------------------------------------------------------------+
+bool RenderCore::Shade(PathState& path, const ExtensionHit& hit, ShadowRay& shadowRay)
+{
+	Ray& ray = path.ray;
 
-	if (t_min == numeric_limits<float>::max())
+	if (hit.t == numeric_limits<float>::max())
 	{
 		float u = 1 + atan2f(ray.m_Direction.x, -ray.m_Direction.z) * INVPI;
 		float v = acosf(ray.m_Direction.y) * INVPI;
@@ -225,187 +443,164 @@ float3 RenderCore::Trace(Ray ray, int depth, int x, int y)
 		int yPixel = float(skyHeight) * v;
 		int pixelIdx = yPixel * skyWidth + xPixel;
 
-		return skyData[max(0, min(skyHeight * skyWidth, pixelIdx))];
+		Accumulate(path.pixelIdx, path.throughput * skyData[max(0, min(skyHeight * skyWidth, pixelIdx))]);
+		return false;
 	}
 
-	if (depth > maxDepth)
+	if (path.depth > maxDepth)
 	{
-		return BLACK;
+		return false;
 	}
 
-	if (material.color.textureID > -1)
-	{
-		CoreTri* triangle = get<0>(intersect);
-
-		auto& texture = textures[material.color.textureID];
+	tuple intersect = ResolveHit(ray, hit);
 
-		float3 p0 = intersectionPoint - triangle->vertex0;
-		float3 p1 = intersectionPoint - triangle->vertex1;
-		float3 p2 = intersectionPoint - triangle->vertex2;
+	float3 normalVector = get<1>(intersect);
+	const CoreMaterial& material = get<2>(intersect);
 
-		// main triangle area a
-		float a = length(cross(p0 - p1, p0 - p2));
-		// p1's triangle area / a
-		float u = length(cross(p1, p2)) / a;
-		// p2's triangle area / a 
-		float v = length(cross(p2, p0)) / a;
-		// p2's triangle area / a 
-		float w = length(cross(p0, p1)) / a; 
+	float3 color = make_float3(material.color.value.x, material.color.value.y, material.color.value.z);
+	float3 intersectionPoint = ray.m_Origin + ray.m_Direction * hit.t;
 
-		float uu = triangle->u0 * u + triangle->u1 * v + triangle->u2 * w;
-		float vv = triangle->v0 * u + triangle->v1 * v + triangle->v2 * w;
+	// The ray cone keeps its spread at every bounce and the next ray starts out as wide
+	// as this one arrived; surface curvature and roughness are ignored.
+	ray.m_ConeWidth += ray.m_ConeSpread * hit.t;
 
-		int xPixel = float(texture.width) * uu;
-		int yPixel = float(texture.height) * vv;
-		int pixelIdx = yPixel + xPixel * texture.width;
+	if (material.color.textureID > -1)
+	{
+		const Texture& texture = textures[material.color.textureID];
+		float lambda = Texture::CalculateLambda(texture.CalculateLOD(get<0>(intersect)), ray.m_ConeWidth, ray.m_Direction, normalVector);
+		color = texture.Sample(get<3>(intersect), lambda);
+	}
 
-		if (pixelIdx > texture.pixelCount)
+	if (material.color.value.x > 1 || material.color.value.y > 1 || material.color.value.z > 1)
+	{
+		// lights are not double sided
+		if (dot(ray.m_Direction, normalVector) < 0)
 		{
-			pixelIdx = texture.pixelCount;
+			float3 contribution = path.throughput * color;
+			int lightIdx = hit.sphereIdx == -1 ? lights.FindTriLight(get<0>(intersect)) : -1;
 
-			printf("Warning index out of range");
-		}
+			// The light could also have been found by next event estimation at the previous
+			// vertex, unless that vertex was the camera or a specular surface: apply MIS.
+			if (path.depth > 0 && !path.specular && lightIdx != -1)
+			{
+				const CoreLightTri& light = lights.triLights[lightIdx];
+				float lightPdf = Lights::CalculateLightPDF(ray.m_Direction, hit.t, light.area, light.N);
+				float pickProb = lights.LightPickProb(lightIdx, ray.m_Origin, path.lastN);
+				contribution *= path.bsdfPdf / (path.bsdfPdf + lightPdf * pickProb);
+			}
 
-		auto uvColors = texture.idata[pixelIdx];
+			Accumulate(path.pixelIdx, contribution);
+		}
 
-		float devision = 1.0f / 255;
-		color = make_float3(uvColors.x * devision, uvColors.y * devision, uvColors.z * devision);
+		return false;
 	}
 
-	if (hitLight)
-	{
-		// Calculate emittance
-		BRDF = mainColor * INVPI;
-		float cos_i = dot(normalVector, ray.m_Direction);
-		// Light is always white in this case
-		float3 returnedColor = PI * 2.0f * BRDF * WHITE * abs(cos_i);
-
-		return returnedColor;
-	}
+	path.depth++;
 
 	if (material.pbrtMaterialType == MaterialType::PBRT_MATTE)
 	{
-		if (firstTimeMatteHit == 0) 
+		// normal on the side the ray came from
+		float3 N = dot(ray.m_Direction, normalVector) > 0 ? -normalVector : normalVector;
+		float3 BRDF = color * INVPI;
+
+		// Next event estimation: connect to a point on a light, weighted against finding
+		// the same point through the BSDF sample below.
+		float r0 = path.sampler.Next();
+		float r1 = path.sampler.Next();
+		float pickProb, lightPdf;
+		float3 lightColor;
+		bool isDelta;
+		float3 L = lights.RandomPointOnLight(r0, r1, intersectionPoint, N, pickProb, lightPdf, lightColor, isDelta) - intersectionPoint;
+		float dist = length(L);
+		L *= 1.0f / dist;
+		float NdotL = dot(N, L);
+
+		if (NdotL > 0 && lightPdf > 0)
 		{
-			mainColor = CalculatePhong(intersectionPoint, normalVector, color, material);
-			updatedColor = mainColor;
+			float bsdfPdf = isDelta ? 0 : NdotL * INVPI;
+			shadowRay.ray = Ray(intersectionPoint + EPSILON * L, L);
+			shadowRay.tMax = dist - 2 * EPSILON;
+			shadowRay.contribution = path.throughput * BRDF * lightColor * (NdotL / (pickProb * lightPdf + bsdfPdf));
+			shadowRay.pixelIdx = path.pixelIdx;
 		}
-		
-		BRDF = updatedColor * INVPI;
-		updatedColor = BRDF;
-		
-		float3 D = Utils::RandomPointOnHemiSphere(normalVector);
-		float3 target = intersectionPoint + EPSILON * D;
-		float3 randomDirection = D;
-
-		ray.m_Origin = target;
-		ray.m_Direction = D;
-
-		float cos_i = dot(normalVector, randomDirection);
 
-		Ei = Trace(ray, depth + 1) * abs(cos_i);
+		// Cosine-weighted direction: BRDF * cos(theta) / pdf is just the albedo.
+		float r2 = path.sampler.Next();
+		float r3 = path.sampler.Next();
+		float3 D = Sampler::CosineWeightedHemisphere(N, r2, r3);
 
-		color = PI * 2.0f * BRDF * Ei;
+		ray.m_Origin = intersectionPoint + EPSILON * D;
+		ray.m_Direction = D;
+		path.throughput *= color;
+		path.bsdfPdf = dot(N, D) * INVPI;
+		path.lastN = N;
+		path.specular = false;
 
-		return color;
+		return RussianRoulette(path);
 	}
 	else if (material.pbrtMaterialType == MaterialType::PBRT_MIRROR)
 	{
 		ray.m_Origin = intersectionPoint;
 		ray.m_Direction = Reflect(ray.m_Direction, normalVector);
+		path.specular = true;
 
-		if (depth == 0)
-		{
-			mainColor = CalculatePhong(intersectionPoint, normalVector, color, material);
-		}
-
-		return Trace(ray, depth + 1);
+		return RussianRoulette(path);
 	}
 	else if (material.pbrtMaterialType == MaterialType::PBRT_GLASS)
 	{
 		// Index of reflection for glass
 		float ior = 1.5;
 
-		float3 m_refractionColor = color;
-		float3 m_reflectionColor = color;
-		float3 m_finalColor = make_float3(0,0,0);
-
 		float3 bias = EPSILON * normalVector;
 		bool outside = dot(ray.m_Direction, normalVector) < 0;
 		float3 newOrigin = outside ? intersectionPoint - bias : intersectionPoint + bias;
 
 		float kr = Fresnel(intersectionPoint, normalVector, ior);
-		
-		if (kr < 1) 
+
+		// Follow either the reflection or the refraction, with the Fresnel weights as
+		// probabilities, so the throughput stays the same.
+		ray.m_Origin = newOrigin;
+		path.specular = true;
+		if (path.sampler.Next() < kr)
 		{
-			float3 m_refractionDirection = Refract(ray.m_Direction, normalVector, ior);
-			ray.m_Origin = newOrigin;
-			ray.m_Direction = normalize(m_refractionDirection);
-			m_refractionColor = Trace(ray, depth + 1);
+			ray.m_Direction = Reflect(ray.m_Direction, normalVector);
+		}
+		else
+		{
+			ray.m_Direction = normalize(Refract(ray.m_Direction, normalVector, ior));
 		}
-		
-		ray.m_Origin = newOrigin;
-		ray.m_Direction = Reflect(ray.m_Direction, normalVector);
-		m_reflectionColor = Trace(ray, depth + 1);
-		
-		m_finalColor += m_reflectionColor * kr + m_refractionColor * (1 - kr);
 
-		return m_finalColor;
+		return RussianRoulette(path);
 	}
 
-	return color;
+	Accumulate(path.pixelIdx, path.throughput * color);
+	return false;
 }
 
-float3 RenderCore::CalculatePhong(float3 origin, float3 normal, float3 m_color, CoreMaterial& material)
+//  +-----------------------------------------------------------------------------+
+//  |  RenderCore::RussianRoulette                                                |
+//  |  From rouletteDepth bounces on, a path survives with a probability equal    |
+//  |  to its brightest throughput channel, and is scaled up by the inverse to    |
+//  |  keep the estimate unbiased. Dark paths end early; bright ones continue     |
+//  |  up to maxDepth.                                                            |
+//  +-----------------------------------------------------------------------------+
+bool RenderCore::RussianRoulette(PathState& path)
 {
-	float3 color = make_float3(0, 0, 0);
-	int lightSourceCount = m_pointLights.size() + m_directionalLight.size() + m_coreTriLight.size() + m_spotLights.size();
-
-	for (CoreLightTri& light : m_coreTriLight)
+	if (path.depth < rouletteDepth)
 	{
-		float3 direction = light.centre - origin;
-		float3 N = normalize(normal);
-		float3 L = normalize(light.centre - origin);
-
-		float lambertian = dot(N, L);
-
-		if (lambertian < 0)
-		{
-			lambertian = 0;
-		}
-
-		float specAngle = 0;
-		float specular = 0;
-
-		// Diffuse coeficient.
-		float kd = 1;
-		// Ambient reflection
-		float ka = 1.0f;
-		// Specular reflection.
-		float ks = 1.0f;
-		// Ambient influence.
-		float ambient = 0.1;
-
-		if (lambertian > 0)
-		{
-			float3 R = reflect(-L, N);      // Reflected light vector
-			float3 V = normalize(-origin); // Vector to viewer
-
-			// Compute the specular term
-			float specAngle = dot(R, V);
-
-			if (specAngle < 0)
-			{
-				specAngle = 0;
-			}
+		return true;
+	}
 
-			specular = pow(specAngle, 75);
-		}
+	const float3& T = path.throughput;
+	float survival = min(1.0f, max(max(T.x, T.y), T.z));
 
-		color += ka * ambient + kd * lambertian * m_color + ks * specular * make_float3(1, 1, 1);
+	if (path.sampler.Next() >= survival)
+	{
+		return false;
 	}
 
-	return color / 1;
+	path.throughput *= 1.0f / survival;
+	return true;
 }
 
 float3 RenderCore::Reflect(float3 in, float3 normal)
@@ -507,65 +702,14 @@ void RenderCore::SetLights(const CoreLightTri* triLights, const int triLightCoun
 	const CoreSpotLight* spotLights, const int spotLightCount,
 	const CoreDirectionalLight* directionalLights, const int directionalLightCount)
 {
-	for (int i = 0; i < pointLightCount; i++)
+	// replaces the lights of the previous call
+	if (triLightCount + pointLightCount + spotLightCount + directionalLightCount == 0)
 	{
-		CorePointLight pointLight{};
-
-		pointLight.position = pointLights[i].position;
-		pointLight.dummy = pointLights[i].dummy;
-		pointLight.energy = pointLights[i].energy;
-		pointLight.radiance = pointLights[i].radiance;
-
-		m_pointLights.push_back(pointLight);
+		lights.Set(0, 0, &defaultLight, 1, 0, 0, 0, 0);
+		return;
 	}
 
-	// not supported yet
-	for (int i = 0; i < spotLightCount; i++)
-	{
-		CoreSpotLight spotlight{};
-
-		spotlight.position = spotLights[i].position;
-		spotlight.dummy = spotLights[i].dummy;
-		spotlight.radiance = spotLights[i].radiance;
-		spotlight.cosOuter = spotLights[i].cosOuter;
-		spotlight.cosInner = spotLights[i].cosInner;
-		spotlight.direction = spotLights[i].direction;
-
-		m_spotLights.push_back(spotlight);
-	}
-
-	// not supported yet
-	for (int i = 0; i < directionalLightCount; i++)
-	{
-		CoreDirectionalLight directionalLight{};
-
-		directionalLight.dummy = directionalLights[i].dummy;
-		directionalLight.energy = directionalLights[i].energy;
-		directionalLight.radiance = directionalLights[i].radiance;
-		directionalLight.direction = directionalLights[i].direction;
-
-		m_directionalLight.push_back(directionalLight);
-	}
-
-	// not supported yet
-	for (int i = 0; i < triLightCount; i++)
-	{
-		CoreLightTri coreLight{};
-
-		coreLight.area = triLights[i].area;
-		coreLight.energy = triLights[i].energy;
-		coreLight.radiance = triLights[i].radiance;
-		coreLight.centre = triLights[i].centre;
-		coreLight.vertex0 = triLights[i].vertex0;
-		coreLight.vertex1 = triLights[i].vertex1;
-		coreLight.vertex2 = triLights[i].vertex2;
-		coreLight.N = triLights[i].N;
-		coreLight.dummy1 = triLights[i].dummy1;
-		coreLight.dummy2 = triLights[i].dummy2;
-		coreLight.triIdx = triLights[i].triIdx;
-
-		m_coreTriLight.push_back(coreLight);
-	}
+	lights.Set(triLights, triLightCount, pointLights, pointLightCount, spotLights, spotLightCount, directionalLights, directionalLightCount);
 }
 
 void lh2core::RenderCore::SetSkyData(const float3* pixels, const uint width, const uint height, const mat4& worldToLight)
@@ -584,18 +728,47 @@ void lh2core::RenderCore::SetTextures(const CoreTexDesc* tex, const int textureC
 
 	for (int i = 0; i < textureCount; i++)
 	{
-		CoreTexDesc texture;
-		texture.fdata = tex[i].fdata;
-		texture.firstPixel = tex[i].firstPixel;
-		texture.flags = tex[i].flags;
-		texture.height = tex[i].height;
-		texture.idata = tex[i].idata;
-		texture.MIPlevels = tex[i].MIPlevels;
-		texture.pixelCount = tex[i].pixelCount;
-		texture.storage = tex[i].storage;
-		texture.width = tex[i].width;
-
-		textures.push_back(texture);
+		textures.push_back(Texture(tex[i], tiledTextures));
+	}
+}
+
+//  +-----------------------------------------------------------------------------+
+//  |  RenderCore::Setting                                                        |
+//  |  Modify a render setting.                                                   |
+//  +-----------------------------------------------------------------------------+
+void RenderCore::Setting( const char* name, const float value )
+{
+	if (!strcmp( name, "bvhBins" ))
+	{
+		// applies to BVHs built after this call
+		bvhBins = clamp( (int)value, 2, BVH::MAXBINS );
+	}
+	else if (!strcmp( name, "bvhWidth" ))
+	{
+		// applies to BVHs built after this call
+		bvhWidth = value >= 4 ? 4 : 2;
+	}
+	else if (!strcmp( name, "tiledTextures" ))
+	{
+		// store texels in tiles (1) or row by row (0); applies to textures set after this call
+		tiledTextures = value != 0;
+	}
+	else if (!strcmp( name, "blueNoise" ))
+	{
+		// blue noise for the first samples of each pixel, xorshift otherwise
+		Sampler::useBlueNoise = value != 0;
+	}
+	else if (!strcmp( name, "maxDepth" ))
+	{
+		// hard cap on the number of bounces; restarts accumulation
+		maxDepth = max( 0, (int)value );
+		samplesTaken = 0;
+	}
+	else if (!strcmp( name, "rouletteDepth" ))
+	{
+		// bounces before Russian roulette may end a path; restarts accumulation
+		rouletteDepth = max( 0, (int)value );
+		samplesTaken = 0;
 	}
 }
 
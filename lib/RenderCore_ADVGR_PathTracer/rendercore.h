@@ -16,23 +16,18 @@
 #pragma once
 #include "Ray.h"
 #include "Sphere.h"
+#include "Mesh.h"
+#include "BVHNode.h"
+#include "TLAS.h"
+#include "Texture.h"
+#include "Sampler.h"
+#include "PathState.h"
+#include "Lights.h"
 #include "rendersystem.h"
 
 namespace lh2core
 {
 
-//  +-----------------------------------------------------------------------------+
-//  |  Mesh                                                                       |
-//  |  Minimalistic mesh storage.                                           LH2'19|
-//  +-----------------------------------------------------------------------------+
-class Mesh
-{
-public:
-	float4* vertices = 0;							// vertex data received via SetGeometry
-	int vcount = 0;									// vertex count
-	CoreTri* triangles = 0;							// 'fat' triangle data
-};
-
 //  +-----------------------------------------------------------------------------+
 //  |  RenderCore                                                                 |
 //  |  Encapsulates device code.                                            LH2'19|
@@ -57,19 +52,23 @@ public:
 
 	// Our methods:
 	void Render(const ViewPyramid& view, const Convergence converge, bool async);
-	float3 Trace(Ray ray, int depth = 0, int x = 0, int y = 0);
-	tuple<CoreTri*, float, float3, CoreMaterial, bool> Intersect(Ray ray);
-	float3 CalculatePhong(float3 origin, float3 normal, float3 m_color, CoreMaterial &material);
+	void Display();
+	bool Shade(PathState& path, const ExtensionHit& hit, ShadowRay& shadowRay);
+	bool RussianRoulette(PathState& path);
+	void Accumulate(int pixelIdx, const float3& color);
+	ExtensionHit Intersect(const Ray& ray);
+	tuple<CoreTri, float3, CoreMaterial, float2> ResolveHit(const Ray& ray, const ExtensionHit& hit);
+	bool IsOccluded(float3 origin, float3 direction, float tMax);
 	float3 Reflect(float3 in, float3 normal);
 	float3 Refract(float3 in, float3 normal, float ior);
 	float Fresnel(float3 in, float3 normal, float ior);
 
 	// unimplemented for the minimal core
 	inline void SetProbePos( const int2 pos ) override {}
-	inline void Setting(const char* name, float value ) override {}
+	void Setting(const char* name, float value ) override;
 
-	inline void SetInstance( const int instanceIdx, const int modelIdx, const mat4& transform ) override {}
-	inline void FinalizeInstances() override {}
+	void SetInstance( const int instanceIdx, const int modelIdx, const mat4& transform ) override;
+	void FinalizeInstances() override;
 
 	// internal methods
 private:
@@ -81,13 +80,7 @@ private:
 public:
 	CoreStats coreStats;							// rendering statistics
 	unsigned int screenPixels[SCRWIDTH * SCRHEIGHT];
-	float3 screenData[SCRWIDTH * SCRHEIGHT];
-
-	float3 mainColor;
-	float3 updatedColor;
-	float3 BRDF;
-	float3 Ei;
-	float firstTimeMatteHit = 0;
+	float4 accumulator[SCRWIDTH * SCRHEIGHT];		// HDR sum of all samples taken per pixel
 
 	vector<float3> skyData;
 	int skyWidth, skyHeight;
@@ -95,22 +88,31 @@ public:
 	// material data storage
 	vector<CoreMaterial> materials;           
 	// texture data storage
-	vector<CoreTexDesc> textures;        
+	vector<Texture> textures;
 
-	 // Point lights.
-	vector<CorePointLight> m_pointLights;
-	// directional lights.
-	vector<CoreDirectionalLight> m_directionalLight; 
-	// Spot lights.
-	vector<CoreSpotLight> m_spotLights; 
-	// Point lights.
-	vector<CoreLightTri> m_coreTriLight; 
+	// Scene lights, for next event estimation.
+	Lights lights;
+	CorePointLight defaultLight{};
 
 	vector<Sphere> m_spheres;
 
-	Ray ray;
-
-	int maxDepth = 4;
+	vector<BVH*> blas;								// bottom-level BVH per mesh index
+	vector<BVHInstance> instances;					// instance data received via SetInstance
+	TLAS tlas;										// top-level BVH over the instances
+	bool instancesDirty = true;						// tlas needs to be rebuilt before rendering
+	int bvhBins = 16;								// SAH bins per axis for new BVH builds
+	int bvhWidth = 4;								// trace single rays through a 2- or 4-wide BVH
+	bool tiledTextures = true;						// store texels in tiles rather than row by row
+	tf::Executor executor;							// worker threads for the wavefront stages
+
+	vector<PathState> paths;						// paths still alive in the current wave
+	vector<PathState> nextPaths;					// survivors of the shade stage, compacted
+	vector<ExtensionHit> hits;						// nearest hit per path, from the extend stage
+	vector<ShadowRay> shadowRays;					// light connections made by the shade stage, compacted
+
+	int maxDepth = 16;								// hard cap on the number of bounces per path
+	int rouletteDepth = 2;							// bounces before Russian roulette starts
+	uint samplesTaken = 0;							// samples per pixel in the accumulator; sample index for the sampler
 };
 
 } // namespace lh2core
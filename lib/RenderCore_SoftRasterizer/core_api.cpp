@@ -14,9 +14,36 @@
 */
 
 #include "core_settings.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// -----------------------------------------------------------
+// HasAVX2
+// the rest of this core is compiled for AVX2 and FMA (see the
+// project settings); this file is not, so that a CPU without
+// them gets an error instead of an illegal instruction
+// -----------------------------------------------------------
+static bool HasAVX2()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid( info, 0 );
+	if (info[0] < 7) return false;
+	// AVX and FMA, and the OS saving the ymm registers
+	__cpuid( info, 1 );
+	const int avx = (1 << 28) | (1 << 27) /* OSXSAVE */ | (1 << 12) /* FMA */;
+	if ((info[2] & avx) != avx || (_xgetbv( 0 ) & 6) != 6) return false;
+	__cpuidex( info, 7, 0 );
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" );
+#endif
+}
 
 extern "C" COREDLL_API CoreAPI_Base* CreateCore()
 {
+	FATALERROR_IF( !HasAVX2(), "The SoftRasterizer core requires a CPU with AVX2 and FMA support." );
 	gladLoadGL(); // the dll needs its own OpenGL function pointers
 	return new RenderCore();
 }
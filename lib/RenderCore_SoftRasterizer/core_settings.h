@@ -22,6 +22,12 @@
 
 // core-specific settings
 // #define NOTEXTURES		// all texture reads will be white
+#define TILEDTEXTURES		// store texels in 4x4 tiles rather than row by row
+#define TILESIZE		64		// width and height of the screen tiles that triangles are binned into
+#define CHUNKSIZE		4096	// vertices or triangles handled by a single geometry task
+#define OCCLUSIONCULLING	// skip meshes & triangle clusters hidden behind large occluders
+#define OCCLUDERSIZE	0.05f	// chunks that cover this fraction of the screen are drawn first, as occluders
+#define VISIBILITYBUFFER	// rasterize depth & polygon IDs only, then shade each visible pixel once
 
 #include "platform.h"
 
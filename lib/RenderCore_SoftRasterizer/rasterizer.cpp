@@ -25,146 +25,238 @@ uint ScaleColor( uint c, int scale )
 	return rb + g;
 }
 
+__m256i ScaleColor8( const __m256i c, const __m256i scale )
+{
+	const __m256i rbMask = _mm256_set1_epi32( 0xff00ff ), gMask = _mm256_set1_epi32( 0xff00 );
+	const __m256i rb = _mm256_and_si256( _mm256_srli_epi32( _mm256_mullo_epi32( _mm256_and_si256( c, rbMask ), scale ), 8 ), rbMask );
+	const __m256i g = _mm256_and_si256( _mm256_srli_epi32( _mm256_mullo_epi32( _mm256_and_si256( c, gMask ), scale ), 8 ), gMask );
+	return _mm256_add_epi32( rb, g );
+}
+
 // -----------------------------------------------------------
 // static data for the rasterizer
 // -----------------------------------------------------------
 Surface* Mesh::screen = 0;
-float* Mesh::xleft, *Mesh::xright, *Mesh::uleft, *Mesh::uright;
-float* Mesh::vleft, *Mesh::vright, *Mesh::zleft, *Mesh::zright;
 Scene Rasterizer::scene;
 float* Rasterizer::zbuffer;
+uint* Rasterizer::idbuffer;
 float4 Rasterizer::frustum[5];
 static float3 raxis[3] = { make_float3( 1, 0, 0 ), make_float3( 0, 1, 0 ), make_float3( 0, 0, 1 ) };
 
+// -----------------------------------------------------------
+// Texture::SetPixels
+// copies row-major pixel data into the layout selected by
+// TILEDTEXTURES; tiled textures are padded to whole tiles.
+// sizes are rounded up to a power of two, resampling other
+// textures to the nearest texel.
+// -----------------------------------------------------------
+void Texture::SetPixels( const uint* src, int w, int h )
+{
+	FREE64( pixels );
+	width = 1, height = 1;
+	while (width < w) width <<= 1;
+	while (height < h) height <<= 1;
+#ifdef TILEDTEXTURES
+	pitch = (width + 3) >> 2;
+	const int size = pitch * ((height + 3) >> 2) * 16;
+#else
+	pitch = width;
+	const int size = width * height;
+#endif
+	pixels = (uint*)MALLOC64( size * sizeof( uint ) );
+	memset( pixels, 255, size * sizeof( uint ) );
+	if (src) for (int y = 0; y < height; y++) for (int x = 0; x < width; x++)
+		pixels[Index( x, y, pitch )] = src[(int)((int64_t)x * w / width) + (int)((int64_t)y * h / height) * w];
+}
+
 // -----------------------------------------------------------
 // Mesh constructor
 // input: vertex count & face count
 // allocates room for mesh data:
 // - pos:  vertex positions
-// - tpos: transformed vertex positions
 // - norm: vertex normals
 // - spos: vertex screen space positions
 // - uv:   vertex uv coordinates
 // - N:    face normals
 // - tri:  connectivity data
+// - original: index of each triangle in SetGeometry's input
+// - cbounds: bounds per cluster of CHUNKSIZE triangles
+// camera space positions live in Rasterizer::tpos, since a
+// mesh may be drawn by several instances at the same time.
 // -----------------------------------------------------------
 Mesh::Mesh( int vcount, int tcount ) : verts( vcount ), tris( tcount )
 {
-	pos = new float3[vcount * 3], tpos = pos + vcount, norm = pos + 2 * vcount;
+	pos = new float3[vcount * 2], norm = pos + vcount;
 	spos = new float2[vcount * 2], uv = spos + vcount, N = new float3[tcount];
 	tri = new int[tcount * 3];
 	material = new int[tcount];
+	original = new int[tcount];
+	clusters = (tcount + CHUNKSIZE - 1) / CHUNKSIZE;
+	cbounds = new float3[clusters * 2];
 }
 
 // -----------------------------------------------------------
-// Mesh render function
+// Mesh::InFrustum
+// checks the mesh bounds against the view frustum
 // input: final matrix for scene graph node
-// renders a mesh using software rasterization.
-// stages:
-// 1. mesh culling: checks the mesh against the view frustum
-// 2. vertex transform: calculates world space coordinates
-// 3. triangle rendering loop. substages:
-//    a) backface culling
-//    b) clipping (Sutherland-Hodgeman)
-//    c) shading (using pre-scaled palettes for speed)
-//    d) projection: world-space to 2D screen-space
-//    e) span construction
-//    f) span filling
 // -----------------------------------------------------------
-void Mesh::Render( const mat4& T )
+bool Mesh::InFrustum( const mat4& T )
 {
-	// cull mesh
 	float3 c[8];
 	for (int i = 0; i < 8; i++) c[i] = make_float3( T * make_float4( bounds[i & 1].x, bounds[(i >> 1) & 1].y, bounds[i >> 2].z, 1 ) );
 	for (int i, p = 0; p < 5; p++)
 	{
 		for (i = 0; i < 8; i++) if ((dot( make_float3( Rasterizer::frustum[p] ), c[i] ) - Rasterizer::frustum[p].w) > 0) break;
-		if (i == 8) return;
-	}
-	// transform vertices
-	for (int i = 0; i < verts; i++) tpos[i] = make_float3( make_float4( pos[i], 1 ) * T );
-	// draw triangles
-	for (int i = 0; i < tris; i++)
-	{
-		Material* mat = Rasterizer::scene.matList[material[i]];
-		static uint p;
-		uint* src = mat->texture ? mat->texture->pixels : &p;
-		if (!mat->texture) p = mat->diffuse;
-		float* zbuffer = Rasterizer::zbuffer, f;
-		const float tw = mat->texture ? (float)mat->texture->width : 1;
-		const float th = mat->texture ? (float)mat->texture->height : 1;
-		const int umask = (int)tw, vmask = (int)th;
+		if (i == 8) return false;
+	}
+	return true;
+}
+
+// -----------------------------------------------------------
+// Mesh::Transform
+// calculates camera space coordinates of a range of vertices,
+// eight at a time
+// input: final matrix for scene graph node, vertex range,
+// destination for vertex 0 of this mesh
+// -----------------------------------------------------------
+void Mesh::Transform( const mat4& T, int first, int last, float4* tpos )
+{
+	__m256 m[12];
+	for (int j = 0; j < 12; j++) m[j] = _mm256_set1_ps( T.cell[j] );
+	const __m256i stride = _mm256_setr_epi32( 0, 3, 6, 9, 12, 15, 18, 21 );
+	int i = first;
+	for (; i + 8 <= last; i += 8)
+	{
+		const float* p = &pos[i].x;
+		const __m256 x = _mm256_i32gather_ps( p, stride, 4 ), y = _mm256_i32gather_ps( p + 1, stride, 4 ), z = _mm256_i32gather_ps( p + 2, stride, 4 );
+		const __m256 tx = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( m[0], x ), _mm256_mul_ps( m[1], y ) ), _mm256_add_ps( _mm256_mul_ps( m[2], z ), m[3] ) );
+		const __m256 ty = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( m[4], x ), _mm256_mul_ps( m[5], y ) ), _mm256_add_ps( _mm256_mul_ps( m[6], z ), m[7] ) );
+		const __m256 tz = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( m[8], x ), _mm256_mul_ps( m[9], y ) ), _mm256_add_ps( _mm256_mul_ps( m[10], z ), m[11] ) );
+		// back to one float4 per vertex
+		for (int h = 0; h < 2; h++)
+		{
+			__m128 r0 = h ? _mm256_extractf128_ps( tx, 1 ) : _mm256_castps256_ps128( tx );
+			__m128 r1 = h ? _mm256_extractf128_ps( ty, 1 ) : _mm256_castps256_ps128( ty );
+			__m128 r2 = h ? _mm256_extractf128_ps( tz, 1 ) : _mm256_castps256_ps128( tz );
+			__m128 r3 = _mm_setzero_ps();
+			_MM_TRANSPOSE4_PS( r0, r1, r2, r3 );
+			_mm_storeu_ps( &tpos[i + h * 4 + 0].x, r0 ), _mm_storeu_ps( &tpos[i + h * 4 + 1].x, r1 );
+			_mm_storeu_ps( &tpos[i + h * 4 + 2].x, r2 ), _mm_storeu_ps( &tpos[i + h * 4 + 3].x, r3 );
+		}
+	}
+	for (; i < last; i++) tpos[i] = make_float4( make_float3( make_float4( pos[i], 1 ) * T ), 0 );
+}
+
+// -----------------------------------------------------------
+// Mesh::Setup
+// prepares a range of triangles for rasterization.
+// substages:
+//    a) backface culling
+//    b) clipping (Sutherland-Hodgeman)
+//    c) shading (using pre-scaled palettes for speed)
+//    d) projection: world-space to 2D screen-space
+//    e) edge functions & attribute planes
+// input: final matrix for scene graph node, transformed
+// vertices of this mesh, triangle range; output is appended
+// to polys.
+// -----------------------------------------------------------
+void Mesh::Setup( const mat4& T, const float4* tpos, int first, int last, vector<ScreenPolygon>& polys )
+{
+	for (int i = first; i < last; i++)
+	{
 		// cull triangle
 		float3 Nt = make_float3( make_float4( N[i], 0 ) * T );
-		if (dot( tpos[tri[i * 3 + 0]], Nt ) > 0) continue;
-		// clip
+		if (dot( make_float3( tpos[tri[i * 3 + 0]] ), Nt ) > 0) continue;
+		// clip, against the planes that a vertex is outside of
 		float3 cpos[2][8], *pos;
 		float2 cuv[2][8], *tuv;
-		int nin = 3, nout = 0, from = 0, to = 1, miny = screen->height - 1, maxy = 0, h;
-		for (int v = 0; v < 3; v++) cpos[0][v] = tpos[tri[i * 3 + v]], cuv[0][v] = uv[tri[i * 3 + v]];
-		for (int p = 0; p < 2; p++, from = 1 - from, to = 1 - to, nin = nout, nout = 0) for (int v = 0; v < nin; v++)
+		int nin = 3, nout = 0, from = 0, to = 1, outside = 0;
+		float f;
+		for (int v = 0; v < 3; v++) cpos[0][v] = make_float3( tpos[tri[i * 3 + v]] ), cuv[0][v] = uv[tri[i * 3 + v]];
+		for (int p = 0; p < 5; p++) for (int v = 0; v < 3; v++)
+			if (dot( make_float3( Rasterizer::frustum[p] ), cpos[0][v] ) - Rasterizer::frustum[p].w < 0) outside |= 1 << p;
+		for (int p = 0; p < 5; p++) if (outside & (1 << p))
 		{
-			const float3 A = cpos[from][v], B = cpos[from][(v + 1) % nin];
-			const float2 Auv = cuv[from][v], Buv = cuv[from][(v + 1) % nin];
-			const float4 plane = Rasterizer::frustum[p];
-			const float t1 = dot( make_float3( plane ), A ) - plane.w, t2 = dot( make_float3( plane ), B ) - plane.w;
-			if ((t1 < 0) && (t2 >= 0))
-				f = t1 / (t1 - t2),
-				cuv[to][nout] = Auv + (Buv - Auv) * f, cpos[to][nout++] = A + f * (B - A),
-				cuv[to][nout] = Buv, cpos[to][nout++] = B;
-			else if ((t1 >= 0) && (t2 >= 0)) cuv[to][nout] = Buv, cpos[to][nout++] = B;
-			else if ((t1 >= 0) && (t2 < 0))
-				f = t1 / (t1 - t2),
-				cuv[to][nout] = Auv + (Buv - Auv) * f, cpos[to][nout++] = A + f * (B - A);
+			for (int v = 0; v < nin; v++)
+			{
+				const float3 A = cpos[from][v], B = cpos[from][(v + 1) % nin];
+				const float2 Auv = cuv[from][v], Buv = cuv[from][(v + 1) % nin];
+				const float4 plane = Rasterizer::frustum[p];
+				const float t1 = dot( make_float3( plane ), A ) - plane.w, t2 = dot( make_float3( plane ), B ) - plane.w;
+				if ((t1 < 0) && (t2 >= 0))
+					f = t1 / (t1 - t2),
+					cuv[to][nout] = Auv + (Buv - Auv) * f, cpos[to][nout++] = A + f * (B - A),
+					cuv[to][nout] = Buv, cpos[to][nout++] = B;
+				else if ((t1 >= 0) && (t2 >= 0)) cuv[to][nout] = Buv, cpos[to][nout++] = B;
+				else if ((t1 >= 0) && (t2 < 0))
+					f = t1 / (t1 - t2),
+					cuv[to][nout] = Auv + (Buv - Auv) * f, cpos[to][nout++] = A + f * (B - A);
+			}
+			from = 1 - from, to = 1 - to, nin = nout, nout = 0;
 		}
-		if (nin == 0) continue;
-		// project
+		if (nin < 3) continue;
+		// project, snapping to 1/16th of a pixel
 		pos = cpos[from], tuv = cuv[from];
+		int2 fp[8];
+		float2 sp[8];
+		float rz[8];
+		int2 fmin = make_int2( INT_MAX ), fmax = make_int2( INT_MIN );
 		for (int v = 0; v < nin; v++)
-			pos[v].x = ((pos[v].x * screen->width) / -pos[v].z) + screen->width / 2,
-			pos[v].y = ((pos[v].y * screen->width) / pos[v].z) + screen->height / 2;
-		// draw
-		uint shade = (uint)((N[i].z + 1) * 64.0f + 127.9f);
-		for (int j = 0; j < nin; j++)
 		{
-			int vert0 = j, vert1 = (j + 1) % nin;
-			if (pos[vert0].y > pos[vert1].y) h = vert0, vert0 = vert1, vert1 = h;
-			const float y0 = pos[vert0].y, y1 = pos[vert1].y, rydiff = 1.0f / (y1 - y0);
-			if ((y0 == y1) || (y0 >= screen->height) || (y1 < 1)) continue;
-			const int iy0 = max( 1, (int)y0 + 1 ), iy1 = min( screen->height - 2, (int)y1 );
-			float x0 = pos[vert0].x, dx = (pos[vert1].x - x0) * rydiff;
-			float z0 = 1.0f / pos[vert0].z, z1 = 1.0f / pos[vert1].z, dz = (z1 - z0) * rydiff;
-			float u0 = tuv[vert0].x * z0, du = (tuv[vert1].x * z1 - u0) * rydiff;
-			float v0 = tuv[vert0].y * z0, dv = (tuv[vert1].y * z1 - v0) * rydiff;
-			const float f = (float)iy0 - y0;
-			x0 += dx * f, u0 += du * f, v0 += dv * f, z0 += dz * f;
-			for (int y = iy0; y <= iy1; y++)
-			{
-				if (x0 < xleft[y]) xleft[y] = x0, uleft[y] = u0, vleft[y] = v0, zleft[y] = z0;
-				if (x0 > xright[y]) xright[y] = x0, uright[y] = u0, vright[y] = v0, zright[y] = z0;
-				x0 += dx, u0 += du, v0 += dv, z0 += dz;
-			}
-			miny = min( miny, iy0 ), maxy = max( maxy, iy1 );
+			const float x = ((pos[v].x * screen->width) / -pos[v].z) + screen->width / 2;
+			const float y = ((pos[v].y * screen->width) / pos[v].z) + screen->height / 2;
+			fp[v] = make_int2( (int)floorf( x * 16 + 0.5f ), (int)floorf( y * 16 + 0.5f ) );
+			sp[v] = make_float2( (float)fp[v].x, (float)fp[v].y ) * (1.0f / 16);
+			rz[v] = 1.0f / pos[v].z;
+			fmin = min( fmin, fp[v] ), fmax = max( fmax, fp[v] );
 		}
-		for (int y = miny; y <= maxy; xleft[y] = screen->width - 1, xright[y++] = 0)
+		// pixels are sampled at integer coordinates
+		ScreenPolygon poly;
+		poly.pmin = make_int2( max( 0, (fmin.x + 15) >> 4 ), max( 0, (fmin.y + 15) >> 4 ) );
+		poly.pmax = make_int2( min( screen->width - 1, fmax.x >> 4 ), min( screen->height - 1, fmax.y >> 4 ) );
+		if (poly.pmin.x > poly.pmax.x || poly.pmin.y > poly.pmax.y) continue;
+		// edge functions, with the inside on the positive side
+		int64_t area = 0;
+		for (int v = 0; v < nin; v++) area += (int64_t)fp[v].x * fp[(v + 1) % nin].y - (int64_t)fp[(v + 1) % nin].x * fp[v].y;
+		if (area == 0) continue;
+		const int sign = area > 0 ? 1 : -1;
+		poly.count = 0;
+		for (int v = 0; v < nin; v++)
 		{
-			float x0 = xleft[y], x1 = xright[y], rxdiff = 1.0f / (x1 - x0);
-			float u0 = uleft[y], du = (uright[y] - u0) * rxdiff;
-			float v0 = vleft[y], dv = (vright[y] - v0) * rxdiff;
-			float z0 = zleft[y], dz = (zright[y] - z0) * rxdiff;
-			const int ix0 = (int)x0 + 1, ix1 = min( screen->width - 2, (int)x1 );
-			const float f = (float)ix0 - x0;
-			u0 += f * du, v0 += f * dv, z0 += f * dz;
-			uint* dest = screen->pixels + y * screen->width;
-			float* zbuf = zbuffer + y * screen->width;
-			for (int x = ix0; x <= ix1; x++, u0 += du, v0 += dv, z0 += dz) // plot span
-			{
-				if (z0 >= zbuf[x]) continue;
-				const float z = 1.0f / z0;
-				const uint u = (uint)(u0 * z * tw) % umask, v = (uint)(v0 * z * th) % vmask;
-				dest[x] = ScaleColor( src[u + v * umask], shade ), zbuf[x] = z0;
-			}
+			const int2 a = fp[v], b = fp[(v + 1) % nin];
+			const int dx = (b.x - a.x) * sign, dy = (b.y - a.y) * sign;
+			if (dx == 0 && dy == 0) continue;
+			const int e = poly.count++;
+			poly.A[e] = -dy * 16, poly.B[e] = dx * 16;
+			poly.C[e] = (int64_t)dy * a.x - (int64_t)dx * a.y;
+			// pixels exactly on an edge belong to one side only
+			if (!(poly.A[e] > 0 || (poly.A[e] == 0 && poly.B[e] > 0))) poly.C[e]--;
 		}
+		// attribute planes, from the largest triangle in the fan around vertex 0
+		int best = 1;
+		float bestArea = 0;
+		for (int v = 1; v < nin - 1; v++)
+		{
+			const float2 e1 = sp[v] - sp[0], e2 = sp[v + 1] - sp[0];
+			const float a = fabsf( e1.x * e2.y - e2.x * e1.y );
+			if (a > bestArea) best = v, bestArea = a;
+		}
+		const float2 e1 = sp[best] - sp[0], e2 = sp[best + 1] - sp[0];
+		const float rdet = 1.0f / (e1.x * e2.y - e2.x * e1.y);
+		auto plane = [&]( const float f0, const float f1, const float f2 )
+		{
+			const float d1 = f1 - f0, d2 = f2 - f0;
+			const float a = (d1 * e2.y - d2 * e1.y) * rdet, b = (d2 * e1.x - d1 * e2.x) * rdet;
+			return make_float3( a, b, f0 - a * sp[0].x - b * sp[0].y );
+		};
+		const int v1 = best, v2 = best + 1;
+		poly.zPlane = plane( rz[0], rz[v1], rz[v2] );
+		poly.uPlane = plane( tuv[0].x * rz[0], tuv[v1].x * rz[v1], tuv[v2].x * rz[v2] );
+		poly.vPlane = plane( tuv[0].y * rz[0], tuv[v1].y * rz[v1], tuv[v2].y * rz[v2] );
+		poly.tri = i;
+		poly.shade = (uint)((N[i].z + 1) * 64.0f + 127.9f);
+		poly.mat = Rasterizer::scene.matList[material[i]];
+		polys.push_back( poly );
 	}
 }
 
@@ -179,39 +271,54 @@ Scene::~Scene()
 }
 
 // -----------------------------------------------------------
-// SGNode::Render
-// recursive rendering of a scene graph node and its child nodes
-// input: (inverse) camera transform
+// SGNode::Collect
+// recursive traversal of a scene graph node and its child
+// nodes; adds the meshes in the view frustum to draws
+// input: (inverse) camera transform, index of the instance
+// (child of the root) that this node belongs to
 // -----------------------------------------------------------
-void SGNode::Render( const mat4& transform )
+void SGNode::Collect( const mat4& transform, vector<Draw>& draws, int instance )
 {
 	mat4 M = transform * localTransform;
-	if (GetType() == SG_MESH) ((Mesh*)this)->Render( M );
-	for (uint s = (uint)child.size(), i = 0; i < s; i++) child[i]->Render( M );
+	if (GetType() == SG_MESH && ((Mesh*)this)->InFrustum( M )) draws.push_back( Draw{ (Mesh*)this, M, instance, 0, false } );
+	for (uint s = (uint)child.size(), i = 0; i < s; i++) child[i]->Collect( M, draws, instance < 0 ? (int)i : instance );
 }
 
 // -----------------------------------------------------------
-// Rasterizer::Init
-// initialization of the rasterizer
-// input: surface to draw to
+// ParallelFor
+// calls body(i) for all i in [0, count) on every worker of
+// the executor; indices are handed out one by one
 // -----------------------------------------------------------
-void Rasterizer::Init()
+template <class Body> static void ParallelFor( tf::Executor& executor, int count, const Body& body )
 {
-	// setup outline tables & zbuffer
-	Mesh::xleft = new float[8192], Mesh::xright = new float[8192]; // that should do for pretty much any resolution
-	Mesh::uleft = new float[8192], Mesh::uright = new float[8192];
-	Mesh::vleft = new float[8192], Mesh::vright = new float[8192];
-	Mesh::zleft = new float[8192], Mesh::zright = new float[8192];
+	atomic<int> next{ 0 };
+	tf::Taskflow taskflow;
+	for (size_t i = 0; i < executor.num_workers(); i++) taskflow.emplace( [&]()
+	{
+		for (int j = next++; j < count; j = next++) body( j );
+	} );
+	executor.run( taskflow ).wait();
 }
 
+// -----------------------------------------------------------
+// Rasterizer::Reinit
+// initialization that depends on screen size
+// input: surface to draw to
+// -----------------------------------------------------------
 void Rasterizer::Reinit( int w, int h, Surface* screen )
 {
-	// initialization that depends on screen size
-	for (int y = 0; y < h; y++) Mesh::xleft[y] = w - 1, Mesh::xright[y] = 0;
 	delete zbuffer;
 	zbuffer = new float[w * h];
-	// calculate view frustum planes
-	float C = -1.0f, x1 = 0.5f, x2 = w - 1.5f, y1 = 0.5f, y2 = h - 1.5f;
+	delete idbuffer;
+	idbuffer = new uint[w * h];
+	tilesX = (w + TILESIZE - 1) / TILESIZE;
+	tilesY = (h + TILESIZE - 1) / TILESIZE;
+	blocksX = (w + 7) >> 3;
+	blockDepth.resize( blocksX * ((h + 7) >> 3) );
+	tileDepth.resize( tilesX * tilesY );
+	// calculate view frustum planes; the planes keep polygons within pixels
+	// 0.5 .. w - 1.5 and 0.5 .. h - 1.5, where the projection flips y
+	float C = -1.0f, x1 = 0.5f, x2 = w - 1.5f, y1 = 1.5f, y2 = h - 0.5f;
 	float3 p0 = { 0, 0, 0 };
 	float3 p1 = { ((x1 - w * 0.5f) * C) / w, ((y1 - h * 0.5f) * C) / w, 1.0f };
 	float3 p2 = { ((x2 - w * 0.5f) * C) / w, ((y1 - h * 0.5f) * C) / w, 1.0f };
@@ -230,12 +337,390 @@ void Rasterizer::Reinit( int w, int h, Surface* screen )
 // Rasterizer::Render
 // render the scene
 // input: camera to render with
+// stages:
+// 1. mesh culling: checks the meshes against the view frustum
+//    and splits their triangles in chunks of CHUNKSIZE
+// 2. occluders: with OCCLUSIONCULLING, chunks that cover much
+//    of the screen are drawn first; the other chunks are only
+//    drawn if their bounds are not hidden behind them
+// 3. shading: with VISIBILITYBUFFER, once per visible pixel
+// chunks are drawn by DrawChunks.
 // -----------------------------------------------------------
 void Rasterizer::Render( const mat4& transform )
 {
-	memset( Mesh::screen->pixels, 0, Mesh::screen->width * Mesh::screen->height * sizeof( uint ) );
-	memset( zbuffer, 0, Mesh::screen->width * Mesh::screen->height * sizeof( float ) );
-	scene.root->Render( transform.Inverted() );
+	// collect visible meshes and reserve room for their vertices
+	draws.clear();
+	scene.root->Collect( transform.Inverted(), draws );
+	int vertexCount = 0, chunkCount = 0;
+	for (Draw& draw : draws)
+	{
+		draw.firstVertex = vertexCount, vertexCount += draw.mesh->verts;
+		chunkCount += (draw.mesh->tris + CHUNKSIZE - 1) / CHUNKSIZE;
+	}
+	if ((int)tpos.size() < vertexCount) tpos.resize( vertexCount );
+	// split the triangles into chunks; chunk storage is kept between frames
+	chunks.resize( chunkCount );
+	for (int i = 0, c = 0; i < (int)draws.size(); i++)
+	{
+		const Mesh* mesh = draws[i].mesh;
+		for (int first = 0; first < mesh->tris; first += CHUNKSIZE, c++) chunks[c].draw = i, chunks[c].first = first, chunks[c].last = min( first + CHUNKSIZE, mesh->tris );
+	}
+#ifdef OCCLUSIONCULLING
+	// occluders: chunks that cover a large part of the screen, or reach the near plane
+	const float occluderArea = OCCLUDERSIZE * Mesh::screen->width * Mesh::screen->height;
+	vector<int> occluders, others, visible;
+	for (int i = 0; i < chunkCount; i++)
+	{
+		GeometryChunk& chunk = chunks[i];
+		const Mesh* mesh = draws[chunk.draw].mesh;
+		const float3* bounds = mesh->clusters > 1 ? mesh->cbounds + (chunk.first / CHUNKSIZE) * 2 : mesh->bounds;
+		const bool nearPlane = !ProjectBounds( draws[chunk.draw].transform, bounds, chunk.pmin, chunk.pmax, chunk.zNear );
+		const float area = (float)max( 0, chunk.pmax.x - chunk.pmin.x + 1 ) * (float)max( 0, chunk.pmax.y - chunk.pmin.y + 1 );
+		(nearPlane || area >= occluderArea ? occluders : others).push_back( i );
+	}
+	DrawChunks( occluders, true );
+	if (!others.empty())
+	{
+		ParallelFor( executor, tilesX * tilesY, [&]( int i ) { BuildDepthPyramid( i ); } );
+		// meshes that were not transformed for the occluders are tested as a whole first
+		vector<char> hidden( draws.size(), 0 );
+		for (int i = 0; i < (int)draws.size(); i++) if (!draws[i].transformed)
+		{
+			int2 pmin, pmax;
+			float zNear;
+			const Draw& draw = draws[i];
+			hidden[i] = ProjectBounds( draw.transform, draw.mesh->bounds, pmin, pmax, zNear ) && Occluded( pmin, pmax, zNear );
+		}
+		for (int i : others) if (!hidden[chunks[i].draw] && !Occluded( chunks[i].pmin, chunks[i].pmax, chunks[i].zNear )) visible.push_back( i );
+		DrawChunks( visible, false );
+	}
+#else
+	vector<int> all( chunkCount );
+	for (int i = 0; i < chunkCount; i++) all[i] = i;
+	DrawChunks( all, true );
+#endif
+#ifdef VISIBILITYBUFFER
+	ParallelFor( executor, tilesX * tilesY, [&]( int i ) { ShadeTile( i ); } );
+#endif
+}
+
+// -----------------------------------------------------------
+// Rasterizer::DrawChunks
+// draws a list of chunks, in parallel
+// stages:
+// 1. vertex transform: camera space coordinates for draws
+//    that were not transformed yet, in chunks of CHUNKSIZE
+//    vertices
+// 2. triangle setup & binning, per chunk
+// 3. rasterization, per screen tile; the tiles are cleared
+//    first if requested
+// -----------------------------------------------------------
+void Rasterizer::DrawChunks( const vector<int>& list, bool clear )
+{
+	// transform
+	vector<int3> vertexJobs; // draw, first, last
+	for (int c : list)
+	{
+		Draw& draw = draws[chunks[c].draw];
+		if (draw.transformed) continue;
+		draw.transformed = true;
+		for (int first = 0; first < draw.mesh->verts; first += CHUNKSIZE) vertexJobs.push_back( make_int3( chunks[c].draw, first, min( first + CHUNKSIZE, draw.mesh->verts ) ) );
+	}
+	ParallelFor( executor, (int)vertexJobs.size(), [&]( int i )
+	{
+		const Draw& draw = draws[vertexJobs[i].x];
+		draw.mesh->Transform( draw.transform, vertexJobs[i].y, vertexJobs[i].z, tpos.data() + draw.firstVertex );
+	} );
+	// setup & bin
+	ParallelFor( executor, (int)list.size(), [&]( int i )
+	{
+		GeometryChunk& chunk = chunks[list[i]];
+		const Draw& draw = draws[chunk.draw];
+		chunk.polys.clear();
+		draw.mesh->Setup( draw.transform, tpos.data() + draw.firstVertex, chunk.first, chunk.last, chunk.polys );
+		BinPolygons( chunk );
+	} );
+	// rasterize; chunks are visited in order, so ties in depth resolve in list order
+	ParallelFor( executor, tilesX * tilesY, [&]( int i ) { RenderTile( i, list, clear ); } );
+}
+
+// -----------------------------------------------------------
+// Rasterizer::BinPolygons
+// sorts the polygons of a chunk by the tiles they overlap,
+// using a counting sort on the tile index
+// -----------------------------------------------------------
+void Rasterizer::BinPolygons( GeometryChunk& chunk )
+{
+	const int tileCount = tilesX * tilesY;
+	chunk.binStart.assign( tileCount + 1, 0 );
+	for (const ScreenPolygon& poly : chunk.polys)
+		for (int ty = poly.pmin.y / TILESIZE; ty <= poly.pmax.y / TILESIZE; ty++)
+			for (int tx = poly.pmin.x / TILESIZE; tx <= poly.pmax.x / TILESIZE; tx++) chunk.binStart[tx + ty * tilesX + 1]++;
+	for (int t = 0; t < tileCount; t++) chunk.binStart[t + 1] += chunk.binStart[t];
+	chunk.binPolys.resize( chunk.binStart[tileCount] );
+	vector<int> next( chunk.binStart.begin(), chunk.binStart.end() - 1 );
+	for (int i = 0; i < (int)chunk.polys.size(); i++)
+	{
+		const ScreenPolygon& poly = chunk.polys[i];
+		for (int ty = poly.pmin.y / TILESIZE; ty <= poly.pmax.y / TILESIZE; ty++)
+			for (int tx = poly.pmin.x / TILESIZE; tx <= poly.pmax.x / TILESIZE; tx++) chunk.binPolys[next[tx + ty * tilesX]++] = i;
+	}
+}
+
+// -----------------------------------------------------------
+// Rasterizer::RenderTile
+// draws the polygons of a list of chunks that were binned
+// into a tile, optionally clearing the tile first
+// -----------------------------------------------------------
+void Rasterizer::RenderTile( int tileIdx, const vector<int>& list, bool clear )
+{
+	Surface* screen = Mesh::screen;
+	const int x0 = (tileIdx % tilesX) * TILESIZE, x1 = min( x0 + TILESIZE, screen->width );
+	const int y0 = (tileIdx / tilesX) * TILESIZE, y1 = min( y0 + TILESIZE, screen->height );
+	if (clear) for (int y = y0; y < y1; y++)
+	{
+	#ifdef VISIBILITYBUFFER
+		memset( idbuffer + x0 + y * screen->width, 255, (x1 - x0) * sizeof( uint ) );
+	#else
+		memset( screen->pixels + x0 + y * screen->width, 0, (x1 - x0) * sizeof( uint ) );
+	#endif
+		memset( zbuffer + x0 + y * screen->width, 0, (x1 - x0) * sizeof( float ) );
+	}
+	for (int c : list)
+	{
+		const GeometryChunk& chunk = chunks[c];
+		for (int i = chunk.binStart[tileIdx]; i < chunk.binStart[tileIdx + 1]; i++)
+			RasterizePolygon( chunk.polys[chunk.binPolys[i]], c * CHUNKSIZE + chunk.binPolys[i], x0, y0, x1, y1 );
+	}
+}
+
+// -----------------------------------------------------------
+// Rasterizer::BuildDepthPyramid
+// stores the largest 1 / depth, i.e. the farthest depth, of
+// the 8x8 blocks of a tile and of the tile itself. Empty
+// pixels have 0, which is farther than anything. The outer
+// rows and columns of the screen are never drawn: the view
+// frustum ends half a pixel before them.
+// -----------------------------------------------------------
+void Rasterizer::BuildDepthPyramid( int tileIdx )
+{
+	Surface* screen = Mesh::screen;
+	const int x0 = (tileIdx % tilesX) * TILESIZE, x1 = min( x0 + TILESIZE, screen->width );
+	const int y0 = (tileIdx / tilesX) * TILESIZE, y1 = min( y0 + TILESIZE, screen->height );
+	float tileMax = -1e34f;
+	for (int by = y0; by < y1; by += 8) for (int bx = x0; bx < x1; bx += 8)
+	{
+		float blockMax = -1e34f;
+		for (int y = max( 1, by ); y < min( min( by + 8, y1 ), screen->height - 1 ); y++)
+			for (int x = max( 1, bx ); x < min( min( bx + 8, x1 ), screen->width - 1 ); x++) blockMax = max( blockMax, zbuffer[x + y * screen->width] );
+		blockDepth[(bx >> 3) + (by >> 3) * blocksX] = blockMax;
+		tileMax = max( tileMax, blockMax );
+	}
+	tileDepth[tileIdx] = tileMax;
+}
+
+// -----------------------------------------------------------
+// Rasterizer::ProjectBounds
+// calculates the pixels that a transformed bounding box may
+// cover, and the nearest 1 / depth of its corners.
+// returns false if the box reaches the near plane.
+// -----------------------------------------------------------
+bool Rasterizer::ProjectBounds( const mat4& T, const float3* bounds, int2& pmin, int2& pmax, float& zNear )
+{
+	Surface* screen = Mesh::screen;
+	float2 smin = make_float2( 1e34f ), smax = make_float2( -1e34f );
+	zNear = 1e34f;
+	for (int i = 0; i < 8; i++)
+	{
+		const float3 c = make_float3( T * make_float4( bounds[i & 1].x, bounds[(i >> 1) & 1].y, bounds[i >> 2].z, 1 ) );
+		if (-c.z <= frustum[0].w) return false;
+		const float2 p = make_float2( ((c.x * screen->width) / -c.z) + screen->width / 2, ((c.y * screen->width) / c.z) + screen->height / 2 );
+		smin = fminf( smin, p ), smax = fmaxf( smax, p ), zNear = min( zNear, 1.0f / c.z );
+	}
+	pmin = make_int2( max( 1, (int)floorf( smin.x ) ), max( 1, (int)floorf( smin.y ) ) );
+	pmax = make_int2( min( screen->width - 2, (int)ceilf( smax.x ) ), min( screen->height - 2, (int)ceilf( smax.y ) ) );
+	return true;
+}
+
+// -----------------------------------------------------------
+// Rasterizer::Occluded
+// checks if a screen rectangle at the specified nearest
+// depth is entirely behind the drawn pixels; tiles are
+// checked before their blocks
+// -----------------------------------------------------------
+bool Rasterizer::Occluded( int2 pmin, int2 pmax, float zNear )
+{
+	if (pmin.x > pmax.x || pmin.y > pmax.y) return true; // off screen
+	for (int ty = pmin.y / TILESIZE; ty <= pmax.y / TILESIZE; ty++) for (int tx = pmin.x / TILESIZE; tx <= pmax.x / TILESIZE; tx++)
+	{
+		if (zNear > tileDepth[tx + ty * tilesX]) continue;
+		const int bx0 = max( pmin.x, tx * TILESIZE ) >> 3, bx1 = min( pmax.x, tx * TILESIZE + TILESIZE - 1 ) >> 3;
+		const int by0 = max( pmin.y, ty * TILESIZE ) >> 3, by1 = min( pmax.y, ty * TILESIZE + TILESIZE - 1 ) >> 3;
+		for (int by = by0; by <= by1; by++) for (int bx = bx0; bx <= bx1; bx++) if (zNear <= blockDepth[bx + by * blocksX]) return false;
+	}
+	return true;
+}
+
+// -----------------------------------------------------------
+// ShadeRow
+// colors of a row of 8 pixels of a polygon: 1 / depth, and
+// u / depth and v / depth in texels, in; texture sizes are
+// powers of two, so wrapping uses masks
+// -----------------------------------------------------------
+static __m256i ShadeRow( const ScreenPolygon& poly, const __m256 z, const __m256 u, const __m256 v, const __m256i mask )
+{
+	const Texture* tex = poly.mat->texture;
+	if (!tex) return _mm256_set1_epi32( ScaleColor( poly.mat->diffuse, poly.shade ) );
+	// reciprocal with one Newton-Raphson step
+	const __m256 r = _mm256_rcp_ps( z ), depth = _mm256_mul_ps( r, _mm256_sub_ps( _mm256_set1_ps( 2 ), _mm256_mul_ps( z, r ) ) );
+	const __m256i tu = _mm256_and_si256( _mm256_cvttps_epi32( _mm256_floor_ps( _mm256_mul_ps( u, depth ) ) ), _mm256_set1_epi32( tex->width - 1 ) );
+	const __m256i tv = _mm256_and_si256( _mm256_cvttps_epi32( _mm256_floor_ps( _mm256_mul_ps( v, depth ) ) ), _mm256_set1_epi32( tex->height - 1 ) );
+	const __m256i idx = Texture::Index8( tu, tv, _mm256_set1_epi32( tex->pitch ) );
+	const __m256i texel = _mm256_mask_i32gather_epi32( _mm256_setzero_si256(), (const int*)tex->pixels, idx, mask, 4 );
+	return ScaleColor8( texel, _mm256_set1_epi32( poly.shade ) );
+}
+
+// -----------------------------------------------------------
+// Rasterizer::RasterizePolygon
+// draws the part of a polygon that lies within a tile; with
+// VISIBILITYBUFFER, id is stored instead of a color.
+// substages:
+//    a) edges that hold for the entire tile are dropped
+//    b) per 8x8 block: trivial reject, or a list of the edges
+//       that cross the block; blocks inside all edges need no
+//       edge tests at all
+//    c) per row of 8 pixels: coverage, depth test and texture
+//       lookup for all pixels at once
+// -----------------------------------------------------------
+void Rasterizer::RasterizePolygon( const ScreenPolygon& poly, uint id, int tx0, int ty0, int tx1, int ty1 )
+{
+	// edge functions at the tile origin
+	int E[8], A[8], B[8], edges = 0;
+	for (int i = 0; i < poly.count; i++)
+	{
+		const int64_t e = poly.C[i] + (int64_t)poly.A[i] * tx0 + (int64_t)poly.B[i] * ty0;
+		const int64_t lo = e + (int64_t)(min( 0, poly.A[i] ) + min( 0, poly.B[i] )) * (TILESIZE - 1);
+		const int64_t hi = e + (int64_t)(max( 0, poly.A[i] ) + max( 0, poly.B[i] )) * (TILESIZE - 1);
+		if (hi < 0) return;
+		if (lo >= 0) continue;
+		E[edges] = (int)e, A[edges] = poly.A[i], B[edges] = poly.B[i], edges++;
+	}
+	// uv in texels
+	Surface* screen = Mesh::screen;
+	const Texture* tex = poly.mat->texture;
+	const float tw = tex ? (float)tex->width : 1, th = tex ? (float)tex->height : 1;
+	const float3 zPlane = poly.zPlane, uPlane = poly.uPlane * tw, vPlane = poly.vPlane * th;
+	const __m256i lane = _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 ), minusOne = _mm256_set1_epi32( -1 );
+	const __m256 laneF = _mm256_cvtepi32_ps( lane );
+	// blocks are aligned to the tile
+	const int xs = max( tx0, poly.pmin.x ), xe = min( tx1 - 1, poly.pmax.x );
+	const int ys = max( ty0, poly.pmin.y ), ye = min( ty1 - 1, poly.pmax.y );
+	for (int by = ty0 + ((ys - ty0) & ~7); by <= ye; by += 8) for (int bx = tx0 + ((xs - tx0) & ~7); bx <= xe; bx += 8)
+	{
+		// classify the block against the edges
+		__m256i edgeRow[8], edgeStep[8];
+		int partial = 0, i = 0;
+		for (; i < edges; i++)
+		{
+			const int e = E[i] + A[i] * (bx - tx0) + B[i] * (by - ty0);
+			if (e + (max( 0, A[i] ) + max( 0, B[i] )) * 7 < 0) break;
+			if (e + (min( 0, A[i] ) + min( 0, B[i] )) * 7 >= 0) continue;
+			edgeRow[partial] = _mm256_add_epi32( _mm256_set1_epi32( e ), _mm256_mullo_epi32( _mm256_set1_epi32( A[i] ), lane ) );
+			edgeStep[partial++] = _mm256_set1_epi32( B[i] );
+		}
+		if (i < edges) continue;
+		// 1 / depth, u / depth and v / depth for the first row
+		const float fx = (float)bx, fy = (float)by;
+		__m256 z = _mm256_add_ps( _mm256_set1_ps( zPlane.x * fx + zPlane.y * fy + zPlane.z ), _mm256_mul_ps( _mm256_set1_ps( zPlane.x ), laneF ) );
+		__m256 u = _mm256_add_ps( _mm256_set1_ps( uPlane.x * fx + uPlane.y * fy + uPlane.z ), _mm256_mul_ps( _mm256_set1_ps( uPlane.x ), laneF ) );
+		__m256 v = _mm256_add_ps( _mm256_set1_ps( vPlane.x * fx + vPlane.y * fy + vPlane.z ), _mm256_mul_ps( _mm256_set1_ps( vPlane.x ), laneF ) );
+		const __m256 dz = _mm256_set1_ps( zPlane.y ), du = _mm256_set1_ps( uPlane.y ), dv = _mm256_set1_ps( vPlane.y );
+		const __m256i columns = _mm256_cmpgt_epi32( _mm256_set1_epi32( xe + 1 - bx ), lane );
+		for (int y = by; y <= min( by + 7, ye ); y++)
+		{
+			const __m256 rowZ = z, rowU = u, rowV = v;
+			z = _mm256_add_ps( z, dz ), u = _mm256_add_ps( u, du ), v = _mm256_add_ps( v, dv );
+			__m256i inside = columns;
+			for (int j = 0; j < partial; j++)
+			{
+				inside = _mm256_and_si256( inside, _mm256_cmpgt_epi32( edgeRow[j], minusOne ) );
+				edgeRow[j] = _mm256_add_epi32( edgeRow[j], edgeStep[j] );
+			}
+			if (_mm256_testz_si256( inside, inside )) continue;
+			// depth test: closer fragments have a smaller 1 / depth
+			float* zbuf = zbuffer + bx + y * screen->width;
+			const __m256 zOld = _mm256_maskload_ps( zbuf, inside );
+			const __m256i visible = _mm256_and_si256( inside, _mm256_castps_si256( _mm256_cmp_ps( rowZ, zOld, _CMP_LT_OQ ) ) );
+			if (_mm256_testz_si256( visible, visible )) continue;
+		#ifdef VISIBILITYBUFFER
+			_mm256_maskstore_epi32( (int*)idbuffer + bx + y * screen->width, visible, _mm256_set1_epi32( id ) );
+		#else
+			_mm256_maskstore_epi32( (int*)screen->pixels + bx + y * screen->width, visible, ShadeRow( poly, rowZ, rowU, rowV, visible ) );
+		#endif
+			_mm256_maskstore_ps( zbuf, visible, rowZ );
+		}
+	}
+}
+
+// -----------------------------------------------------------
+// Rasterizer::ShadeTile
+// colors the pixels of a tile from the visibility buffer.
+// rows of 8 pixels are shaded per polygon that they show, so
+// rows within a single polygon take one pass.
+// -----------------------------------------------------------
+void Rasterizer::ShadeTile( int tileIdx )
+{
+	Surface* screen = Mesh::screen;
+	const int x0 = (tileIdx % tilesX) * TILESIZE, x1 = min( x0 + TILESIZE, screen->width );
+	const int y0 = (tileIdx / tilesX) * TILESIZE, y1 = min( y0 + TILESIZE, screen->height );
+	const __m256i lane = _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 );
+	const __m256 laneF = _mm256_cvtepi32_ps( lane );
+	for (int y = y0; y < y1; y++) for (int x = x0; x < x1; x += 8)
+	{
+		const int offset = x + y * screen->width;
+		const __m256i columns = _mm256_cmpgt_epi32( _mm256_set1_epi32( x1 - x ), lane );
+		const __m256i ids = _mm256_maskload_epi32( (const int*)idbuffer + offset, columns );
+		const __m256 z = _mm256_maskload_ps( zbuffer + offset, columns );
+		__m256i color = _mm256_setzero_si256();
+		uint id[8];
+		_mm256_storeu_si256( (__m256i*)id, ids );
+		int pending = _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_andnot_si256( _mm256_cmpeq_epi32( ids, _mm256_set1_epi32( NOPOLYGON ) ), columns ) ) );
+		for (int i = 0; pending; i++) if (pending & (1 << i))
+		{
+			const __m256i same = _mm256_and_si256( _mm256_cmpeq_epi32( ids, _mm256_set1_epi32( id[i] ) ), columns );
+			const ScreenPolygon& poly = chunks[id[i] / CHUNKSIZE].polys[id[i] % CHUNKSIZE];
+			const Texture* tex = poly.mat->texture;
+			const float tw = tex ? (float)tex->width : 1, th = tex ? (float)tex->height : 1;
+			const float3 uPlane = poly.uPlane * tw, vPlane = poly.vPlane * th;
+			const float fx = (float)x, fy = (float)y;
+			const __m256 u = _mm256_add_ps( _mm256_set1_ps( uPlane.x * fx + uPlane.y * fy + uPlane.z ), _mm256_mul_ps( _mm256_set1_ps( uPlane.x ), laneF ) );
+			const __m256 v = _mm256_add_ps( _mm256_set1_ps( vPlane.x * fx + vPlane.y * fy + vPlane.z ), _mm256_mul_ps( _mm256_set1_ps( vPlane.x ), laneF ) );
+			color = _mm256_blendv_epi8( color, ShadeRow( poly, z, u, v, same ), same );
+			pending &= ~_mm256_movemask_ps( _mm256_castsi256_ps( same ) );
+		}
+		_mm256_maskstore_epi32( (int*)screen->pixels + offset, columns, color );
+	}
+}
+
+// -----------------------------------------------------------
+// Rasterizer::Probe
+// finds the instance and triangle visible at a pixel, and
+// their distance to the camera, for object picking
+// returns false if the pixel shows no geometry.
+// -----------------------------------------------------------
+bool Rasterizer::Probe( const int2 pos, int& instance, int& triangle, float& dist )
+{
+	Surface* screen = Mesh::screen;
+	if (!screen || pos.x < 0 || pos.y < 0 || pos.x >= screen->width || pos.y >= screen->height) return false;
+	const uint id = idbuffer[pos.x + pos.y * screen->width];
+	if (id == NOPOLYGON) return false;
+	const GeometryChunk& chunk = chunks[id / CHUNKSIZE];
+	const Draw& draw = draws[chunk.draw];
+	instance = draw.instance, triangle = draw.mesh->original[chunk.polys[id % CHUNKSIZE].tri];
+	// zbuffer holds 1 / z, with z along the view direction
+	const float dx = (pos.x - screen->width / 2) / (float)screen->width, dy = (pos.y - screen->height / 2) / (float)screen->width;
+	dist = -sqrtf( 1 + dx * dx + dy * dy ) / zbuffer[pos.x + pos.y * screen->width];
+	return true;
 }
 
-// EOF
\ No newline at end of file
+// EOF
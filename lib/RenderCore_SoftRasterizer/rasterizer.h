@@ -38,16 +38,41 @@ public:
 // Texture class
 // encapsulates a palettized pixel surface with pre-scaled
 // palettes for fast shading
+// with TILEDTEXTURES, pixels are stored in 4x4 tiles of one
+// cache line each, so spans that cross the texture at an
+// angle touch fewer lines; pitch is then in tiles
+// width and height are powers of two, so that texture
+// coordinates wrap with a mask
 // -----------------------------------------------------------
 class Texture
 {
 public:
 	// constructor / destructor
 	Texture() = default;
-	Texture( int w, int h ) : width( w ), height( h ) { pixels = (uint*)MALLOC64( w * h * sizeof( uint ) ); }
 	~Texture() { FREE64( pixels ); }
+	// methods
+	void SetPixels( const uint* src, int w, int h );
+	static uint Index( const uint u, const uint v, const uint pitch )
+	{
+	#ifdef TILEDTEXTURES
+		return (((v >> 2) * pitch + (u >> 2)) << 4) + ((v & 3) << 2) + (u & 3);
+	#else
+		return u + v * pitch;
+	#endif
+	}
+	static __m256i Index8( const __m256i u, const __m256i v, const __m256i pitch )
+	{
+		const __m256i three = _mm256_set1_epi32( 3 );
+	#ifdef TILEDTEXTURES
+		const __m256i tile = _mm256_add_epi32( _mm256_mullo_epi32( _mm256_srli_epi32( v, 2 ), pitch ), _mm256_srli_epi32( u, 2 ) );
+		const __m256i texel = _mm256_add_epi32( _mm256_slli_epi32( _mm256_and_si256( v, three ), 2 ), _mm256_and_si256( u, three ) );
+		return _mm256_add_epi32( _mm256_slli_epi32( tile, 4 ), texel );
+	#else
+		return _mm256_add_epi32( u, _mm256_mullo_epi32( v, pitch ) );
+	#endif
+	}
 	// data members
-	int width = 0, height = 0;
+	int width = 0, height = 0, pitch = 0;
 	uint* pixels = 0;
 };
 
@@ -65,6 +90,9 @@ public:
 	Texture* texture = 0;			// texture
 };
 
+struct Draw;
+struct ScreenPolygon;
+
 // -----------------------------------------------------------
 // SGNode class
 // scene graph node, with convenience functions for translate
@@ -86,7 +114,7 @@ public:
 	// methods
 	void SetPosition( float3& pos ) { mat4& M = localTransform; M[3] = pos.x, M[7] = pos.y, M[11] = pos.z; }
 	float3 GetPosition() { mat4& M = localTransform; return make_float3( M[3], M[7], M[11] ); }
-	void Render( const mat4& transform );
+	void Collect( const mat4& transform, vector<Draw>& draws, int instance = -1 );
 	virtual int GetType() { return SG_TRANSFORM; }
 	// data members
 	mat4 localTransform;
@@ -103,26 +131,82 @@ public:
 	// constructor / destructor
 	Mesh() : verts( 0 ), tris( 0 ), pos( 0 ), uv( 0 ), spos( 0 ) {}
 	Mesh( int vcount, int tcount );
-	~Mesh() { delete pos; delete N; delete spos; delete tri; }
+	~Mesh() { delete pos; delete N; delete spos; delete tri; delete[] material; delete[] cbounds; delete[] original; }
 	// methods
-	void Render( const mat4& transform );
+	bool InFrustum( const mat4& transform );
+	void Transform( const mat4& transform, int first, int last, float4* tpos );
+	void Setup( const mat4& transform, const float4* tpos, int first, int last, vector<ScreenPolygon>& polys );
 	virtual int GetType() { return SG_MESH; }
 	// data members
 	float3* pos = 0;				// object-space vertex positions
-	float3* tpos = 0;				// world-space positions
 	float2* uv = 0;					// vertex uv coordinates
 	float2* spos = 0;				// screen positions
 	float3* norm = 0;				// vertex normals
 	float3* N = 0;					// triangle plane
 	int* tri = 0;					// connectivity data
-	int verts = 0, tris = 0;		// vertex & triangle count
+	int verts = 0, tris = 0;		// vertex & triangle count; room for 3 vertices per triangle
 	int* material = 0;				// per-face material ID
+	int* original = 0;				// per-face index in the triangles passed to SetGeometry
 	float3 bounds[2];				// mesh bounds
+	int clusters = 0;				// number of clusters of CHUNKSIZE triangles
+	float3* cbounds = 0;			// cluster bounds, two per cluster
 	static Surface* screen;
-	static float* xleft, *xright;	// outline tables for rasterization
-	static float* uleft, *uright;
-	static float* vleft, *vright;
-	static float* zleft, *zright;
+};
+
+// -----------------------------------------------------------
+// Draw struct
+// a mesh instance that survived frustum culling, with its
+// final transform; its vertices are transformed into
+// Rasterizer::tpos, starting at firstVertex, once a chunk of
+// the draw is drawn
+// -----------------------------------------------------------
+struct Draw
+{
+	Mesh* mesh;
+	mat4 transform;
+	int instance;					// index of the instance in the scene root
+	int firstVertex;
+	bool transformed;
+};
+
+// -----------------------------------------------------------
+// ScreenPolygon struct
+// a triangle after clipping and projection, ready to be
+// rasterized. Vertices are snapped to 1/16th of a pixel and
+// the edges become integer edge functions: pixel (x, y) is
+// inside edge i if A[i] * x + B[i] * y + C[i] >= 0, so
+// polygons that share an edge never both cover a pixel on
+// it. 1 / depth, u / depth and v / depth are linear in
+// screen space and stored as planes:
+// value = plane.x * x + plane.y * y + plane.z
+// -----------------------------------------------------------
+struct ScreenPolygon
+{
+	int A[8], B[8];					// edge function steps per pixel
+	int64_t C[8];					// edge function values at pixel (0, 0)
+	float3 zPlane, uPlane, vPlane;	// 1 / depth, u / depth, v / depth
+	int count;						// number of edges
+	int tri;						// triangle index in the mesh
+	int2 pmin, pmax;				// pixels that may be covered, inclusive
+	uint shade;						// scale for the texel colors
+	const Material* mat;
+};
+
+// -----------------------------------------------------------
+// GeometryChunk struct
+// output of a single geometry task: the polygons set up for
+// a range of triangles of one draw, binned per screen tile.
+// The polygons of tile t are binPolys[binStart[t]] up to
+// binPolys[binStart[t + 1]], in triangle order.
+// -----------------------------------------------------------
+struct GeometryChunk
+{
+	int draw, first, last;			// triangle range in the draw's mesh
+	int2 pmin, pmax;				// screen bounds of the triangles; see ProjectBounds
+	float zNear;
+	vector<ScreenPolygon> polys;
+	vector<int> binStart;
+	vector<int> binPolys;
 };
 
 // -----------------------------------------------------------
@@ -147,6 +231,19 @@ public:
 // Rasterizer class
 // rasterizer
 // implements a basic, but fast & accurate software rasterizer
+// sort-middle: vertices are transformed and triangles set up
+// and binned in parallel chunks, after which every screen
+// tile is rasterized by a single thread, which owns the
+// pixels and depths of that tile. Tiles are rasterized in
+// blocks of 8x8 pixels, a row of 8 pixels at a time (AVX2).
+// with OCCLUSIONCULLING, chunks that cover a large part of
+// the screen are drawn first; the maximum depth per 8x8
+// block and per tile then serves to skip hidden meshes and
+// clusters before their vertices are transformed.
+// with VISIBILITYBUFFER, rasterization only stores depth and
+// the ID of the polygon per pixel (chunk * CHUNKSIZE + index
+// in the chunk); every visible pixel is then shaded exactly
+// once, by ShadeTile.
 // -----------------------------------------------------------
 class Rasterizer
 {
@@ -154,13 +251,31 @@ public:
 	// constructor / destructor
 	Rasterizer() = default;
 	// methods
-	void Init();
 	void Reinit( int w, int h, Surface* screen );
 	void Render( const mat4& transform );
+	void DrawChunks( const vector<int>& list, bool clear );
+	void BinPolygons( GeometryChunk& chunk );
+	void RenderTile( int tileIdx, const vector<int>& list, bool clear );
+	void BuildDepthPyramid( int tileIdx );
+	bool ProjectBounds( const mat4& transform, const float3* bounds, int2& pmin, int2& pmax, float& zNear );
+	bool Occluded( int2 pmin, int2 pmax, float zNear );
+	void RasterizePolygon( const ScreenPolygon& poly, uint id, int x0, int y0, int x1, int y1 );
+	void ShadeTile( int tileIdx );
+	bool Probe( const int2 pos, int& instance, int& triangle, float& dist );
 	// data members
 	static Scene scene;
 	static float* zbuffer;
+	static uint* idbuffer;			// polygon IDs, with VISIBILITYBUFFER
+	static constexpr uint NOPOLYGON = 0xffffffff;
 	static float4 frustum[5];
+	int tilesX = 0, tilesY = 0;		// screen size in tiles
+	int blocksX = 0;				// screen width in 8x8 blocks
+	vector<Draw> draws;				// visible mesh instances of the current frame
+	vector<float4> tpos;			// camera space vertices of all draws; w is unused
+	vector<GeometryChunk> chunks;	// triangle setup output, in draw order
+	vector<float> blockDepth;		// per 8x8 block: largest 1 / depth, i.e. the farthest
+	vector<float> tileDepth;		// per tile: largest 1 / depth
+	tf::Executor executor;			// worker threads for all stages
 };
 
 } // namespace lh2core
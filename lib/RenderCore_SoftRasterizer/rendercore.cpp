@@ -38,7 +38,6 @@ void RenderCore::Init()
 	printf( "Initializing SoftRasterizer core - RELEASE build.\n" );
 #endif
 	// initialize scene
-	rasterizer.Init();
 	rasterizer.scene.root = new SGNode();
 }
 
@@ -68,6 +67,15 @@ void RenderCore::SetTarget( GLTexture* target, const uint spp )
 	rasterizer.Reinit( scrwidth, scrheight, renderTarget );
 }
 
+// spreads the lower 10 bits of v over bits 0, 3, 6, ... 27, for Morton codes
+static uint SpreadBits( uint v )
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	return (v * 0x00000005u) & 0x49249249u;
+}
+
 //  +-----------------------------------------------------------------------------+
 //  |  RenderCore::SetGeometry                                                    |
 //  |  Set the geometry data for a model.                                   LH2'19|
@@ -84,18 +92,61 @@ void RenderCore::SetGeometry( const int meshIdx, const float4* vertexData, const
 	else mesh = meshes[meshIdx]; // overwrite geometry data; assume vertex/face count does not change
 	float3 bmin = make_float3( 1e34f ), bmax = -bmin;
 	for (int i = 0; i < vertexCount; i++)
-		mesh->pos[i] = make_float3( vertexData[i] ),
 		bmin.x = min( bmin.x, vertexData[i].x ), bmin.y = min( bmin.y, vertexData[i].y ), bmin.z = min( bmin.z, vertexData[i].z ),
 		bmax.x = max( bmax.x, vertexData[i].x ), bmax.y = max( bmax.y, vertexData[i].y ), bmax.z = max( bmax.z, vertexData[i].z );
 	mesh->bounds[0] = bmin, mesh->bounds[1] = bmax;
-	for (int i = 0; i < triangleCount * 3; i++) mesh->tri[i] = i;
+	// order the triangles along a Morton curve through their centroids: triangles that are
+	// close in space end up close in memory, and so do their vertices and the triangles of
+	// a cluster
+	const float3 extent = bmax - bmin;
+	const float3 scale = make_float3( extent.x > 0 ? 1023 / extent.x : 0, extent.y > 0 ? 1023 / extent.y : 0, extent.z > 0 ? 1023 / extent.z : 0 );
+	vector<uint64_t> order( triangleCount ); // Morton code in the upper half, triangle index in the lower
+	for (int i = 0; i < triangleCount; i++)
+	{
+		const float3 c = ((make_float3( vertexData[i * 3] ) + make_float3( vertexData[i * 3 + 1] ) + make_float3( vertexData[i * 3 + 2] )) * (1.0f / 3) - bmin) * scale;
+		order[i] = ((uint64_t)(SpreadBits( (uint)c.x ) | (SpreadBits( (uint)c.y ) << 1) | (SpreadBits( (uint)c.z ) << 2)) << 32) + i;
+	}
+	sort( order.begin(), order.end() );
+	// weld the corners of the triangles into shared vertices: corners with the same position,
+	// normal and uv become a single vertex, numbered in order of first use
+	struct Corner { float3 pos, N; float2 uv; };
+	vector<Corner> corners( vertexCount );
 	for (int i = 0; i < triangleCount; i++)
-		mesh->norm[i * 3 + 0] = triangles[i].vN0, mesh->norm[i * 3 + 1] = triangles[i].vN1, mesh->norm[i * 3 + 2] = triangles[i].vN2,
-		mesh->uv[i * 3 + 0] = make_float2( triangles[i].u0, triangles[i].v0 ),
-		mesh->uv[i * 3 + 1] = make_float2( triangles[i].u1, triangles[i].v1 ),
-		mesh->uv[i * 3 + 2] = make_float2( triangles[i].u2, triangles[i].v2 ),
-		mesh->N[i] = make_float3( triangles[i].Nx, triangles[i].Ny, triangles[i].Nz ),
-		mesh->material[i] = triangles[i].material;
+	{
+		const int t = (int)(order[i] & 0xffffffff);
+		const CoreTri& tri = triangles[t];
+		corners[i * 3 + 0] = Corner{ make_float3( vertexData[t * 3 + 0] ), tri.vN0, make_float2( tri.u0, tri.v0 ) };
+		corners[i * 3 + 1] = Corner{ make_float3( vertexData[t * 3 + 1] ), tri.vN1, make_float2( tri.u1, tri.v1 ) };
+		corners[i * 3 + 2] = Corner{ make_float3( vertexData[t * 3 + 2] ), tri.vN2, make_float2( tri.u2, tri.v2 ) };
+		mesh->N[i] = make_float3( tri.Nx, tri.Ny, tri.Nz ), mesh->material[i] = tri.material, mesh->original[i] = t;
+	}
+	vector<int> sorted( vertexCount ), first( vertexCount );
+	for (int i = 0; i < vertexCount; i++) sorted[i] = i;
+	sort( sorted.begin(), sorted.end(), [&]( int a, int b ) { const int c = memcmp( &corners[a], &corners[b], sizeof( Corner ) ); return c < 0 || (c == 0 && a < b); } );
+	for (int i = 0; i < vertexCount; i++)
+	{
+		const bool same = i > 0 && memcmp( &corners[sorted[i]], &corners[sorted[i - 1]], sizeof( Corner ) ) == 0;
+		first[sorted[i]] = same ? first[sorted[i - 1]] : sorted[i];
+	}
+	mesh->verts = 0;
+	for (int i = 0; i < vertexCount; i++)
+	{
+		if (first[i] == i)
+		{
+			const int v = mesh->verts++;
+			mesh->pos[v] = corners[i].pos, mesh->norm[v] = corners[i].N, mesh->uv[v] = corners[i].uv;
+			mesh->tri[i] = v;
+		}
+		else mesh->tri[i] = mesh->tri[first[i]];
+	}
+	// cluster bounds, for occlusion culling of parts of large meshes
+	for (int c = 0; c < mesh->clusters; c++)
+	{
+		float3 cmin = make_float3( 1e34f ), cmax = -cmin;
+		for (int i = c * CHUNKSIZE * 3; i < min( (c + 1) * CHUNKSIZE, triangleCount ) * 3; i++)
+			cmin = fminf( cmin, mesh->pos[mesh->tri[i]] ), cmax = fmaxf( cmax, mesh->pos[mesh->tri[i]] );
+		mesh->cbounds[c * 2] = cmin, mesh->cbounds[c * 2 + 1] = cmax;
+	}
 }
 
 //  +-----------------------------------------------------------------------------+
@@ -138,10 +189,8 @@ void RenderCore::SetTextures( const CoreTexDesc* tex, const int textures )
 		Texture* t;
 		if (i < rasterizer.scene.texList.size()) t = rasterizer.scene.texList[i];
 		else rasterizer.scene.texList.push_back( t = new Texture() );
-		t->pixels = (uint*)MALLOC64( tex[i].pixelCount * sizeof( uint ) );
-		if (tex[i].idata) memcpy( t->pixels, tex[i].idata, tex[i].pixelCount * sizeof( uint ) );
-		else memcpy( t->pixels, 0, tex[i].pixelCount * sizeof( uint ) /* assume integer textures */ );
-		t->width = tex[i].width, t->height = tex[i].height;
+		// only level 0 is used; textures without integer data stay white
+		t->SetPixels( (const uint*)tex[i].idata, tex[i].width, tex[i].height );
 	}
 }
 
@@ -217,6 +266,13 @@ void RenderCore::Render( const ViewPyramid& view, const Convergence converge, bo
 	transform[1] = Y.x, transform[5] = Y.y, transform[9] = Y.z;
 	transform[2] = Z.x, transform[6] = Z.y, transform[10] = Z.z;
 	rasterizer.Render( mat4::Translate( view.pos ) * transform );
+#ifdef VISIBILITYBUFFER
+	// picking: the visibility buffer knows what is visible at the probe position
+	int instance, triangle;
+	float dist;
+	if (rasterizer.Probe( probePos, instance, triangle, dist )) coreStats.SetProbeInfo( instance, triangle, dist );
+	else coreStats.SetProbeInfo( -1, -1, 0 );
+#endif
 	// copy cpu surface to OpenGL render target texture
 	glBindTexture( GL_TEXTURE_2D, targetTextureID );
 	glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, scrwidth, scrheight, 0, GL_RGBA, GL_UNSIGNED_BYTE, renderTarget->pixels );